@@ -19,8 +19,7 @@ int main(){
   int send[10] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10 };
   int recv[2] = { 0 };
   
-  zf_send(fd, (char*)send, sizeof(int)*size);
-  zf_recv(fd, (char*)recv, sizeof(int)*2);
+  zf_xfer(fd, (char*)send, sizeof(int)*size, (char*)recv, sizeof(int)*2);
   
   printf("Length: %d, Sum: %d\n", recv[0], recv[1]);
   
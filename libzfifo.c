@@ -1,5 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/ioctl.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -15,6 +17,7 @@ int zf_send(int fd, char* data, unsigned long len){
   return ioctl(fd, IOCTL_SEND, &io);
 }
 
+// Receive one packet into up to len bytes, returns the bytes received
 int zf_recv(int fd, char* data, unsigned long len){
   zfifo_io io;
 
@@ -24,6 +27,278 @@ int zf_recv(int fd, char* data, unsigned long len){
   return ioctl(fd, IOCTL_RECV, &io);
 }
 
+// zf_recv() also returning the descriptor (from 0) the packet ended in
+int zf_recv_eop(int fd, char* data, unsigned long len, unsigned* eof_desc){
+  zfifo_recv_io io;
+  int rc;
+
+  io.data = data;
+  io.len = len;
+
+  rc = ioctl(fd, IOCTL_RECV_EOP, &io);
+  if (rc >= 0 && eof_desc != NULL) *eof_desc = io.eof_desc;
+  return rc;
+}
+
+// zf_send()/zf_recv() also reporting the transfer in *ex; ex is filled
+// in when the DMA fails (-EIO) as well
+int zf_send_ex(int fd, char* data, unsigned long len, zfifo_io_ex* ex){
+  ex->data = data;
+  ex->len = len;
+
+  return ioctl(fd, IOCTL_SEND_EX, ex);
+}
+
+int zf_recv_ex(int fd, char* data, unsigned long len, zfifo_io_ex* ex){
+  ex->data = data;
+  ex->len = len;
+
+  return ioctl(fd, IOCTL_RECV_EX, ex);
+}
+
 int zf_reset(int fd){
   return ioctl(fd, IOCTL_RESET, 0);
 }
+
+int zf_register(int fd, char* data, unsigned long len, int flags){
+  zfifo_reg reg;
+
+  reg.data = data;
+  reg.len = len;
+  reg.flags = flags;
+
+  return ioctl(fd, IOCTL_REG_BUF, &reg);
+}
+
+int zf_unregister(int fd, int handle){
+  return ioctl(fd, IOCTL_UNREG_BUF, handle);
+}
+
+int zf_send_reg(int fd, int handle, unsigned long len){
+  zfifo_reg_io io;
+
+  io.handle = handle;
+  io.len = len;
+
+  return ioctl(fd, IOCTL_SEND_REG, &io);
+}
+
+int zf_recv_reg(int fd, int handle, unsigned long len){
+  zfifo_reg_io io;
+
+  io.handle = handle;
+  io.len = len;
+
+  return ioctl(fd, IOCTL_RECV_REG, &io);
+}
+
+static int zf_submit(int fd, unsigned long req, char* data, int handle,
+                     unsigned long len, zfifo_cookie* cookie){
+  zfifo_async_io io;
+  int rc;
+
+  io.data = data;
+  io.handle = handle;
+  io.len = len;
+
+  rc = ioctl(fd, req, &io);
+  if (rc == 0 && cookie != NULL) *cookie = io.cookie;
+  return rc;
+}
+
+int zf_submit_send(int fd, char* data, unsigned long len, zfifo_cookie* cookie){
+  return zf_submit(fd, IOCTL_SUBMIT_SEND, data, -1, len, cookie);
+}
+
+int zf_submit_recv(int fd, char* data, unsigned long len, zfifo_cookie* cookie){
+  return zf_submit(fd, IOCTL_SUBMIT_RECV, data, -1, len, cookie);
+}
+
+int zf_submit_send_reg(int fd, int handle, unsigned long len,
+                       zfifo_cookie* cookie){
+  return zf_submit(fd, IOCTL_SUBMIT_SEND, NULL, handle, len, cookie);
+}
+
+int zf_submit_recv_reg(int fd, int handle, unsigned long len,
+                       zfifo_cookie* cookie){
+  return zf_submit(fd, IOCTL_SUBMIT_RECV, NULL, handle, len, cookie);
+}
+
+// Returns # of completed entries in cpl[] (results filled in), or -1
+int zf_wait(int fd, zfifo_cpl* cpl, unsigned n, unsigned min){
+  zfifo_wait_io w;
+
+  w.cpl = cpl;
+  w.n = n;
+  w.min = min;
+
+  return ioctl(fd, IOCTL_WAIT, &w);
+}
+
+int zf_xfer(int fd, char* txdata, unsigned long txlen,
+            char* rxdata, unsigned long rxlen){
+  zfifo_xfer_io io;
+
+  io.txdata = txdata;
+  io.txlen = txlen;
+  io.rxdata = rxdata;
+  io.rxlen = rxlen;
+
+  return ioctl(fd, IOCTL_XFER, &io);
+}
+
+// Signal eventfd efd on every completion of this fd's transfers (-1: off)
+int zf_set_eventfd(int fd, int efd){
+  return ioctl(fd, IOCTL_SET_EVENTFD, efd);
+}
+
+// Gather nseg segments into one packet (SOF on the first, EOF on the last)
+int zf_sendv(int fd, zfifo_io* seg, unsigned nseg){
+  zfifo_iov_io io;
+
+  io.seg = seg;
+  io.nseg = nseg;
+
+  return ioctl(fd, IOCTL_SENDV, &io);
+}
+
+// Scatter one received packet over nseg segments
+int zf_recvv(int fd, zfifo_io* seg, unsigned nseg){
+  zfifo_iov_io io;
+
+  io.seg = seg;
+  io.nseg = nseg;
+
+  return ioctl(fd, IOCTL_RECVV, &io);
+}
+
+// Send len bytes as packets of frame bytes (the last one may be shorter)
+int zf_send_frames(int fd, char* data, unsigned long len, unsigned long frame){
+  zfifo_frame_io io;
+
+  io.data = data;
+  io.len = len;
+  io.frame = frame;
+  io.frames = NULL;
+
+  return ioctl(fd, IOCTL_SEND_FRAMES, &io);
+}
+
+// Receive packets of up to frame bytes into len bytes, returns # of
+// packets and stores their offset/length into frames[]
+int zf_recv_frames(int fd, char* data, unsigned long len, unsigned long frame,
+                   zfifo_frame* frames){
+  zfifo_frame_io io;
+
+  io.data = data;
+  io.len = len;
+  io.frame = frame;
+  io.frames = frames;
+
+  return ioctl(fd, IOCTL_RECV_FRAMES, &io);
+}
+
+// ----------------------------------------------------------------------
+// Kernel bypass: entries are posted and descriptors polled in user space,
+// the driver thread validates and feeds them (needs bypass_enable=1)
+
+void zf_bypass_close(zf_bypass* bp){
+  int q;
+
+  for (q=0; q<2; q++)
+    if (bp->desc_map[q] != NULL)
+      munmap((void*)bp->desc_map[q], bp->desc_size[q]);
+  if (bp->pool != NULL) munmap(bp->pool, bp->ctl->pool_size);
+  if (bp->ctl != NULL) munmap(bp->ctl, bp->ctl_size);
+  memset(bp, 0, sizeof(*bp));
+}
+
+int zf_bypass_open(int fd, unsigned depth, unsigned pool_size, zf_bypass* bp){
+  zfifo_bypass_setup su;
+  unsigned long page = sysconf(_SC_PAGESIZE);
+  void *p;
+  int q;
+
+  memset(bp, 0, sizeof(*bp));
+  bp->fd = fd;
+  bp->depth = depth;
+
+  su.depth = depth;
+  su.pool_size = pool_size;
+  if (ioctl(fd, IOCTL_BYPASS_SETUP, &su) < 0) return -1;
+
+  // same layout as the driver: header, then the TX and RX entries
+  bp->ctl_size = (((sizeof(zfifo_bypass_ctl) + 63) & ~63UL) +
+                  2 * depth * sizeof(zfifo_bypass_entry) + page - 1) & ~(page-1);
+  p = mmap(NULL, bp->ctl_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+           fd, ZFIFO_MMAP_BYPASS_CTL);
+  if (p == MAP_FAILED) goto err;
+  bp->ctl = p;
+
+  p = mmap(NULL, bp->ctl->pool_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+           fd, ZFIFO_MMAP_BYPASS_POOL);
+  if (p == MAP_FAILED) goto err;
+  bp->pool = p;
+
+  for (q=0; q<2; q++){
+    bp->desc_size[q] = (bp->ctl->desc_offset[q] + 0x40 * depth + page - 1) &
+                       ~(page-1);
+    p = mmap(NULL, bp->desc_size[q], PROT_READ, MAP_SHARED, fd,
+             (q == ZFIFO_BYPASS_TX) ? ZFIFO_MMAP_BYPASS_TXDESC
+                                    : ZFIFO_MMAP_BYPASS_RXDESC);
+    if (p == MAP_FAILED) goto err;
+    bp->desc_map[q] = p;
+    bp->desc[q] = (volatile unsigned*)((char*)p + bp->ctl->desc_offset[q]);
+  }
+  return 0;
+
+ err:
+  zf_bypass_close(bp);
+  return -1;
+}
+
+// Post a transfer of len bytes at offset in the pool to queue q
+// (ZFIFO_BYPASS_TX/RX), returns -1 if the queue is full
+int zf_bypass_post(zf_bypass* bp, int q, unsigned offset, unsigned len,
+                   unsigned flags){
+  zfifo_bypass_entry *ent = (zfifo_bypass_entry*)
+    ((char*)bp->ctl + bp->ctl->q[q].entries);
+  unsigned i = bp->tail[q];
+
+  if (i - bp->head[q] >= bp->depth) return -1;
+
+  ent[i & (bp->depth-1)].offset = offset;
+  ent[i & (bp->depth-1)].len = len;
+  ent[i & (bp->depth-1)].flags = flags;
+  bp->tail[q] = i + 1;
+  return 0;
+}
+
+// Hand the posted entries of queue q to the driver
+void zf_bypass_doorbell(zf_bypass* bp, int q){
+  __sync_synchronize(); // entries before the doorbell
+  bp->ctl->q[q].sq_tail = bp->tail[q];
+  __sync_synchronize(); // doorbell before reading the flag
+  if (bp->ctl->flags & ZFIFO_BYPASS_NEED_WAKEUP)
+    ioctl(bp->fd, IOCTL_BYPASS_WAKEUP, 0);
+}
+
+// Check the oldest entry of queue q: returns 1 when it completed (len:
+// bytes transferred) and consumes it, 0 if not yet, -1 on error
+int zf_bypass_poll(zf_bypass* bp, int q, unsigned* len){
+  unsigned i = bp->head[q];
+  unsigned sts;
+
+  if (i == bp->tail[q] || (int)(bp->ctl->q[q].sq_head - i) <= 0)
+    return (bp->ctl->flags & ZFIFO_BYPASS_ERROR) ? -1 : 0;
+  __sync_synchronize(); // sq_head before the descriptor
+
+  sts = bp->desc[q][(i & (bp->depth-1))*16 + 7];
+  if (!(sts & ZFIFO_BYPASS_CMPLT))
+    return (bp->ctl->flags & ZFIFO_BYPASS_ERROR) ? -1 : 0;
+
+  if (len != NULL) *len = sts & ZFIFO_BYPASS_STS_LEN;
+  bp->head[q] = i + 1;
+  bp->ctl->q[q].cq_head = i + 1;
+  return (sts & ZFIFO_BYPASS_STS_ERR) ? -1 : 1;
+}
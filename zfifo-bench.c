@@ -0,0 +1,710 @@
+// zfifo-bench: DMA loopback throughput and latency benchmark
+//
+// Sweeps transfer sizes, buffer alignments, normal/huge pages, thread
+// counts, wait policies (irq/poll) and submission modes (sync/queued)
+// over a FIFO loopback design (examples/fifo) or the emulated DMA
+// (make EMU=1), and reports GB/s, ops/s, CPU use and latency
+// percentiles as a table, CSV or JSON. Exits with 1 if any transfer
+// failed or, with -V, received wrong data.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/ioctl.h>
+
+#include "zfifo.h"
+
+#define MAX_LIST    64
+#define MAX_DEPTH   256
+#define HUGE_SIZE   (2UL*1024*1024)
+
+typedef struct {
+  unsigned long v[MAX_LIST];
+  int n;
+} num_list;
+
+// one point of the sweep
+typedef struct {
+  unsigned long size;
+  unsigned long align;   // buffer offset from a page boundary
+  int huge;              // MAP_HUGETLB buffers
+  int threads;
+  int wait;              // WAIT_*
+  int queued;            // 0: sync IOCTL_XFER, 1: submit/wait, depth deep
+} bench_conf;
+
+enum { WAIT_KEEP, WAIT_IRQ, WAIT_POLL };
+static const char *wait_name[] = { "keep", "irq", "poll" };
+static const char *fmt_name[]  = { "human", "csv", "json" };
+enum { FMT_HUMAN, FMT_CSV, FMT_JSON };
+
+// options
+static const char *devs[MAX_LIST];
+static int      ndevs = 0;
+static unsigned depth = 4;
+static double   secs = 1.0;
+static unsigned long min_ops = 3;
+static int      fmt = FMT_HUMAN;
+static int      verify = 0;
+static int      fault_check = 0;
+
+typedef struct {
+  const bench_conf *c;
+  const char *dev;
+  int fd;
+  char *txmap, *rxmap;   // mappings, tx/rx at align in them
+  char *tx, *rx;
+  size_t maplen;
+  unsigned long long ops, errors;
+  int bad;               // -V: wrong data received
+  int err;               // errno of the first failure
+  long long *lat;        // ns per op
+  size_t nlat, maxlat;
+  double elapsed;
+  pthread_t th;
+} bench_thread;
+
+static pthread_barrier_t start_barrier;
+
+static long long now_ns(void){
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// ----------------------------------------------------------------------
+// Option parsing
+
+// 64, 4k, 16M, 1G
+static int parse_num(const char *s, unsigned long *v){
+  char *end;
+
+  *v = strtoul(s, &end, 0);
+  switch (*end){
+  case 'k': case 'K': *v <<= 10; end++; break;
+  case 'm': case 'M': *v <<= 20; end++; break;
+  case 'g': case 'G': *v <<= 30; end++; break;
+  }
+  return (end == s || (*end != '\0' && *end != '-' && *end != ':' &&
+                       *end != ',')) ? -1 : (int)(end - s);
+}
+
+// comma separated numbers or ranges min-max[:factor] (x4 by default)
+static int parse_list(const char *s, num_list *l){
+  l->n = 0;
+  while (*s){
+    unsigned long a, b, f = 4;
+    int k;
+
+    if ((k = parse_num(s, &a)) < 0) return -1;
+    s += k;
+    b = a;
+    if (*s == '-'){
+      if ((k = parse_num(++s, &b)) < 0) return -1;
+      s += k;
+      if (*s == ':'){
+        if ((k = parse_num(++s, &f)) < 0 || f < 2) return -1;
+        s += k;
+      }
+    }
+    for (; a <= b && l->n < MAX_LIST; a = (a == 0) ? b + 1 : a * f)
+      l->v[l->n++] = a;
+    if (*s == ',') s++;
+    else if (*s) return -1;
+  }
+  return (l->n == 0) ? -1 : 0;
+}
+
+// comma separated names from names[0..n)
+static int parse_names(const char *s, const char **names, int n, num_list *l){
+  char buf[256], *tok, *save;
+
+  snprintf(buf, sizeof(buf), "%s", s);
+  l->n = 0;
+  for (tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save)){
+    int i;
+
+    for (i=0; i<n && strcmp(tok, names[i]); i++);
+    if (i == n || l->n == MAX_LIST) return -1;
+    l->v[l->n++] = i;
+  }
+  return (l->n == 0) ? -1 : 0;
+}
+
+static void usage(void){
+  fprintf(stderr,
+    "usage: zfifo-bench [options]\n"
+    "  -d dev[,dev..]  devices, thread i uses dev i%%n (/dev/zfifo0)\n"
+    "  -s sizes        bytes, list or min-max[:factor] (64-256M)\n"
+    "  -a aligns       buffer offsets from a page, 4n (0)\n"
+    "  -p pages        normal,huge (normal)\n"
+    "  -j threads      thread counts (1)\n"
+    "  -w waits        irq,poll,keep: sets wait_policy in sysfs (keep)\n"
+    "  -m modes        sync,queued (sync)\n"
+    "  -q depth        transfers in flight per thread when queued (4)\n"
+    "  -t secs         time per point (1)\n"
+    "  -n ops          min transfers per point (3)\n"
+    "  -f format       human,csv,json (human)\n"
+    "  -V              verify the received data\n"
+    "  -F              first check that a failed send leaves the next\n"
+    "                  transfer intact\n");
+  exit(2);
+}
+
+// ----------------------------------------------------------------------
+// Device settings
+
+// sysfs attribute of a device node: /sys/class/zfifo/zfifo0/<attr>
+static void sysfs_path(char *path, size_t n, const char *dev, const char *attr){
+  const char *base = strrchr(dev, '/');
+
+  snprintf(path, n, "/sys/class/zfifo/%s/%s", base ? base + 1 : dev, attr);
+}
+
+static int sysfs_read(const char *dev, const char *attr, char *buf, size_t n){
+  char path[256];
+  FILE *f;
+
+  sysfs_path(path, sizeof(path), dev, attr);
+  if ((f = fopen(path, "r")) == NULL) return -1;
+  if (fgets(buf, n, f) == NULL) buf[0] = '\0';
+  buf[strcspn(buf, "\n")] = '\0';
+  fclose(f);
+  return 0;
+}
+
+static int sysfs_write(const char *dev, const char *attr, const char *val){
+  char path[256];
+  FILE *f;
+  int rc;
+
+  sysfs_path(path, sizeof(path), dev, attr);
+  if ((f = fopen(path, "w")) == NULL) return -1;
+  rc = (fputs(val, f) < 0);
+  rc |= (fclose(f) != 0);
+  return rc ? -1 : 0;
+}
+
+// irq: sleep until the completion interrupt, poll: busy-wait
+static int set_wait(int wait){
+  int i;
+
+  for (i=0; i<ndevs; i++){
+    if (sysfs_write(devs[i], "wait_policy",
+                    (wait == WAIT_POLL) ? "poll" : "sleep") != 0){
+      fprintf(stderr, "zfifo-bench: can't set wait_policy of %s: %s\n",
+              devs[i], strerror(errno));
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// ----------------------------------------------------------------------
+// Buffers
+
+static char *map_buf(size_t len, int huge){
+  void *p = mmap(NULL, len, PROT_READ|PROT_WRITE,
+                 MAP_PRIVATE|MAP_ANONYMOUS|(huge ? MAP_HUGETLB : 0), -1, 0);
+
+  return (p == MAP_FAILED) ? NULL : p;
+}
+
+// offset-only pattern: any packet matches any receive of the same size
+static void fill_pattern(char *p, unsigned long len){
+  unsigned long i;
+
+  for (i=0; i<len; i++)
+    p[i] = (char)(i ^ (i >> 8) ^ (i >> 16));
+}
+
+static int setup_thread(bench_thread *t){
+  const bench_conf *c = t->c;
+  size_t unit = c->huge ? HUGE_SIZE : (size_t)sysconf(_SC_PAGESIZE);
+
+  t->maplen = (c->align + c->size + unit - 1) / unit * unit;
+  t->txmap  = map_buf(t->maplen, c->huge);
+  t->rxmap  = map_buf(t->maplen, c->huge);
+  if (t->txmap == NULL || t->rxmap == NULL) return -1;
+  t->tx = t->txmap + c->align;
+  t->rx = t->rxmap + c->align;
+  fill_pattern(t->tx, c->size);
+  memset(t->rx, 0, c->size);
+
+  t->maxlat = 4096;
+  if ((t->lat = malloc(sizeof(long long) * t->maxlat)) == NULL) return -1;
+
+  if ((t->fd = open(t->dev, O_RDWR | O_SYNC)) < 0) return -1;
+  return 0;
+}
+
+static void cleanup_thread(bench_thread *t){
+  if (t->fd >= 0) close(t->fd);
+  if (t->txmap) munmap(t->txmap, t->maplen);
+  if (t->rxmap) munmap(t->rxmap, t->maplen);
+  free(t->lat);
+}
+
+static void add_lat(bench_thread *t, long long ns){
+  if (t->nlat == t->maxlat){
+    long long *p = realloc(t->lat, sizeof(long long) * t->maxlat * 2);
+
+    if (p == NULL) return; // keep the ones so far
+    t->lat = p;
+    t->maxlat *= 2;
+  }
+  t->lat[t->nlat++] = ns;
+}
+
+// ----------------------------------------------------------------------
+// Transfer loops
+
+static int done_yet(long long t0, unsigned long long ops){
+  return ops >= min_ops && (now_ns() - t0) >= (long long)(secs * 1e9);
+}
+
+// send and receive in one call, the receive armed first
+static void run_sync(bench_thread *t){
+  const bench_conf *c = t->c;
+  long long t0 = now_ns();
+
+  while (!done_yet(t0, t->ops)){
+    long long ts = now_ns();
+
+    if (zf_xfer(t->fd, t->tx, c->size, t->rx, c->size) < 0){
+      t->err = errno;
+      t->errors++;
+      break;
+    }
+    add_lat(t, now_ns() - ts);
+    t->ops++;
+  }
+  t->elapsed = (now_ns() - t0) / 1e9;
+}
+
+// depth receive+send pairs in flight, retired in order; the buffers are
+// shared by all of them
+static void run_queued(bench_thread *t){
+  const bench_conf *c = t->c;
+  zfifo_cpl slot[MAX_DEPTH][2];
+  long long ts[MAX_DEPTH];
+  unsigned head = 0, n = 0;
+  long long t0 = now_ns();
+
+  for (;;){
+    while (n < depth && !t->err && !done_yet(t0, t->ops + n)){
+      unsigned i = (head + n) % depth;
+
+      ts[i] = now_ns();
+      if (zf_submit_recv(t->fd, t->rx, c->size, &slot[i][0].cookie) != 0){
+        t->err = errno;
+        break;
+      }
+      if (zf_submit_send(t->fd, t->tx, c->size, &slot[i][1].cookie) != 0){
+        t->err = errno;
+        // the receive stays queued; close() cancels it
+        break;
+      }
+      n++;
+    }
+    if (n == 0) break;
+
+    if (zf_wait(t->fd, slot[head], 2, 2) < 0){
+      t->err = errno;
+      t->errors++;
+      break;
+    }
+    if (slot[head][0].result < 0 || slot[head][1].result < 0){
+      t->err = (slot[head][0].result < 0) ? -slot[head][0].result :
+                                            -slot[head][1].result;
+      t->errors++;
+    } else {
+      add_lat(t, now_ns() - ts[head]);
+      t->ops++;
+    }
+    head = (head + 1) % depth;
+    n--;
+  }
+  if (t->err && t->errors == 0) t->errors++;
+  t->elapsed = (now_ns() - t0) / 1e9;
+}
+
+static void *bench_main(void *arg){
+  bench_thread *t = arg;
+
+  pthread_barrier_wait(&start_barrier);
+  if (t->c->queued)
+    run_queued(t);
+  else
+    run_sync(t);
+
+  if (verify && t->ops > 0 && memcmp(t->tx, t->rx, t->c->size) != 0)
+    t->bad = 1;
+  return NULL;
+}
+
+// ----------------------------------------------------------------------
+// Measurement and reporting
+
+typedef struct {
+  unsigned long long ops, errors;
+  double secs, gbps, opsps;
+  double cpu;            // this process, % of one CPU
+  double sys;            // whole system, % of all CPUs
+  double p50, p99, p999, max; // us
+  int bad, err;
+} bench_result;
+
+// busy and total jiffies of all CPUs from /proc/stat
+static void cpu_stat(unsigned long long *busy, unsigned long long *total){
+  unsigned long long v[8] = {0};
+  FILE *f = fopen("/proc/stat", "r");
+  int i;
+
+  *busy = *total = 0;
+  if (f == NULL) return;
+  if (fscanf(f, "cpu %llu %llu %llu %llu %llu %llu %llu %llu",
+             &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7]) >= 4){
+    for (i=0; i<8; i++) *total += v[i];
+    *busy = *total - v[3] - v[4]; // idle, iowait
+  }
+  fclose(f);
+}
+
+static double tv_sec(struct timeval tv){
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static int cmp_ll(const void *a, const void *b){
+  long long x = *(const long long*)a, y = *(const long long*)b;
+
+  return (x > y) - (x < y);
+}
+
+static double pct(long long *lat, size_t n, double q){
+  size_t i = (size_t)(q * n);
+
+  if (n == 0) return 0;
+  return lat[(i < n) ? i : n - 1] / 1e3;
+}
+
+// Returns -1 if the point could not be set up (skipped)
+static int run_point(const bench_conf *c, bench_result *r){
+  bench_thread t[c->threads];
+  struct rusage ru0, ru1;
+  unsigned long long busy0, total0, busy1, total1, bytes;
+  long long *lat;
+  size_t nlat = 0;
+  int i, rc = 0;
+
+  memset(t, 0, sizeof(t));
+  memset(r, 0, sizeof(*r));
+  for (i=0; i<c->threads; i++){
+    t[i].c   = c;
+    t[i].dev = devs[i % ndevs];
+    t[i].fd  = -1;
+    if (setup_thread(&t[i]) != 0){
+      fprintf(stderr, "zfifo-bench: %s: skipped, %s\n",
+              c->huge ? "huge pages" : t[i].dev, strerror(errno));
+      if (!c->huge) *r = (bench_result){ .errors = 1, .err = errno };
+      rc = -1;
+    }
+  }
+  if (rc != 0) goto out;
+
+  // a warm-up transfer on each thread
+  for (i=0; i<c->threads; i++)
+    zf_xfer(t[i].fd, t[i].tx, c->size, t[i].rx, c->size);
+
+  pthread_barrier_init(&start_barrier, NULL, c->threads + 1);
+  for (i=0; i<c->threads; i++)
+    pthread_create(&t[i].th, NULL, bench_main, &t[i]);
+  getrusage(RUSAGE_SELF, &ru0);
+  cpu_stat(&busy0, &total0);
+  pthread_barrier_wait(&start_barrier);
+  for (i=0; i<c->threads; i++)
+    pthread_join(t[i].th, NULL);
+  getrusage(RUSAGE_SELF, &ru1);
+  cpu_stat(&busy1, &total1);
+  pthread_barrier_destroy(&start_barrier);
+
+  for (i=0; i<c->threads; i++){
+    r->ops    += t[i].ops;
+    r->errors += t[i].errors;
+    r->bad    |= t[i].bad;
+    if (t[i].elapsed > r->secs) r->secs = t[i].elapsed;
+    if (t[i].err && !r->err) r->err = t[i].err;
+    nlat += t[i].nlat;
+  }
+  bytes    = r->ops * c->size;
+  r->gbps  = (r->secs > 0) ? bytes / r->secs / 1e9 : 0;
+  r->opsps = (r->secs > 0) ? r->ops / r->secs : 0;
+  r->cpu   = (r->secs > 0) ? 100.0 * (tv_sec(ru1.ru_utime) - tv_sec(ru0.ru_utime) +
+                                      tv_sec(ru1.ru_stime) - tv_sec(ru0.ru_stime))
+                             / r->secs : 0;
+  r->sys   = (total1 > total0) ? 100.0 * (busy1 - busy0) / (total1 - total0) : 0;
+
+  if ((lat = malloc(sizeof(long long) * (nlat + 1))) != NULL){
+    size_t k = 0;
+
+    for (i=0; i<c->threads; i++){
+      memcpy(lat + k, t[i].lat, sizeof(long long) * t[i].nlat);
+      k += t[i].nlat;
+    }
+    qsort(lat, nlat, sizeof(long long), cmp_ll);
+    r->p50  = pct(lat, nlat, 0.50);
+    r->p99  = pct(lat, nlat, 0.99);
+    r->p999 = pct(lat, nlat, 0.999);
+    r->max  = nlat ? lat[nlat-1] / 1e3 : 0;
+    free(lat);
+  }
+
+ out:
+  for (i=0; i<c->threads; i++)
+    cleanup_thread(&t[i]);
+  return rc;
+}
+
+static int nresults = 0;
+
+static void print_header(const char *backend){
+  int i;
+
+  switch (fmt){
+  case FMT_HUMAN:
+    printf("# zfifo-bench on %s (%s)\n", devs[0], backend);
+    printf("%10s %5s %6s %3s %4s %6s %3s %8s %8s %10s %6s %6s %9s %9s %9s %s\n",
+           "size", "align", "pages", "thr", "wait", "mode", "q", "ops",
+           "GB/s", "ops/s", "cpu%", "sys%", "p50us", "p99us", "p999us",
+           "result");
+    break;
+  case FMT_CSV:
+    printf("size,align,pages,threads,wait,mode,depth,ops,errors,secs,gbps,"
+           "ops_per_s,cpu_pct,sys_pct,p50_us,p99_us,p999_us,max_us,result\n");
+    break;
+  case FMT_JSON:
+    printf("{\"tool\":\"zfifo-bench\",\"backend\":\"%s\",\"devices\":[",
+           backend);
+    for (i=0; i<ndevs; i++)
+      printf("%s\"%s\"", i ? "," : "", devs[i]);
+    printf("],\"results\":[\n");
+    break;
+  }
+}
+
+static const char *result_str(const bench_result *r){
+  static char buf[64];
+
+  if (r->errors){
+    snprintf(buf, sizeof(buf), "error:%s", strerror(r->err));
+    return buf;
+  }
+  if (r->bad) return "bad-data";
+  return verify ? "ok" : "-";
+}
+
+static void print_result(const bench_conf *c, const bench_result *r){
+  const char *pages = c->huge ? "huge" : "normal";
+  const char *mode  = c->queued ? "queued" : "sync";
+  unsigned q = c->queued ? depth : 1;
+
+  switch (fmt){
+  case FMT_HUMAN:
+    printf("%10lu %5lu %6s %3d %4s %6s %3u %8llu %8.3f %10.0f %6.1f %6.1f "
+           "%9.1f %9.1f %9.1f %s\n",
+           c->size, c->align, pages, c->threads, wait_name[c->wait], mode, q,
+           r->ops, r->gbps, r->opsps, r->cpu, r->sys,
+           r->p50, r->p99, r->p999, result_str(r));
+    break;
+  case FMT_CSV:
+    printf("%lu,%lu,%s,%d,%s,%s,%u,%llu,%llu,%.6f,%.6f,%.1f,%.1f,%.1f,"
+           "%.3f,%.3f,%.3f,%.3f,%s\n",
+           c->size, c->align, pages, c->threads, wait_name[c->wait], mode, q,
+           r->ops, r->errors, r->secs, r->gbps, r->opsps, r->cpu, r->sys,
+           r->p50, r->p99, r->p999, r->max, result_str(r));
+    break;
+  case FMT_JSON:
+    printf("%s {\"size\":%lu,\"align\":%lu,\"pages\":\"%s\",\"threads\":%d,"
+           "\"wait\":\"%s\",\"mode\":\"%s\",\"depth\":%u,\"ops\":%llu,"
+           "\"errors\":%llu,\"secs\":%.6f,\"gbps\":%.6f,\"ops_per_s\":%.1f,"
+           "\"cpu_pct\":%.1f,\"sys_pct\":%.1f,\"p50_us\":%.3f,"
+           "\"p99_us\":%.3f,\"p999_us\":%.3f,\"max_us\":%.3f,"
+           "\"result\":\"%s\"}",
+           nresults ? ",\n" : "",
+           c->size, c->align, pages, c->threads, wait_name[c->wait], mode, q,
+           r->ops, r->errors, r->secs, r->gbps, r->opsps, r->cpu, r->sys,
+           r->p50, r->p99, r->p999, r->max, result_str(r));
+    break;
+  }
+  nresults++;
+  fflush(stdout);
+}
+
+static void print_footer(void){
+  if (fmt == FMT_JSON) printf("\n]}\n");
+}
+
+// ----------------------------------------------------------------------
+// Fault check
+
+// -F: IOCTL_XFER with an unreadable send buffer fails after the receive
+// was armed. The receive must not stay on S2MM, where it would take the
+// next packet; the next transfer has to bring back exactly its own data.
+static int check_tx_fault(const char *dev){
+  static const unsigned long lens[] = { 64, 64*1024 };
+  char *tx = NULL, *rx = NULL, *bad;
+  int fd, k, rc = -1;
+  unsigned long i;
+
+  if ((fd = open(dev, O_RDWR)) < 0) return -1;
+  bad = mmap(NULL, lens[1], PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (bad == MAP_FAILED || (tx = malloc(lens[1])) == NULL ||
+      (rx = malloc(lens[1])) == NULL){
+    fprintf(stderr, "zfifo-bench: out of memory\n");
+    goto out;
+  }
+
+  for (k=0; k<2; k++){
+    unsigned long len = lens[k];
+
+    for (i=0; i<len/4; i++)
+      ((unsigned*)tx)[i] = (k << 24) | i;
+    if (zf_xfer(fd, bad, len, rx, len) >= 0){
+      fprintf(stderr, "zfifo-bench: %s: send from an unreadable buffer "
+              "did not fail\n", dev);
+      goto out;
+    }
+    memset(rx, 0, len);
+    if (zf_xfer(fd, tx, len, rx, len) != (int)len){
+      fprintf(stderr, "zfifo-bench: %s: %lu bytes after a failed send: "
+              "%s\n", dev, len, strerror(errno));
+      goto out;
+    }
+    if (memcmp(tx, rx, len) != 0){
+      fprintf(stderr, "zfifo-bench: %s: %lu bytes after a failed send: "
+              "wrong data\n", dev, len);
+      goto out;
+    }
+  }
+  rc = 0;
+ out:
+  if (bad != MAP_FAILED) munmap(bad, lens[1]);
+  free(tx);
+  free(rx);
+  close(fd);
+  return rc;
+}
+
+// ----------------------------------------------------------------------
+
+int main(int argc, char **argv){
+  num_list sizes, aligns, pages, threads, waits, modes;
+  char saved_wait[MAX_LIST][32];
+  const char *backend;
+  int opt, s, a, p, j, w, m, failed = 0;
+  char *devarg = NULL;
+
+  parse_list("64-256M", &sizes);
+  parse_list("0", &aligns);
+  parse_list("0", &pages);
+  parse_list("1", &threads);
+  parse_list("0", &waits);
+  parse_list("0", &modes);
+
+  while ((opt = getopt(argc, argv, "d:s:a:p:j:w:m:q:t:n:f:VFh")) != -1){
+    num_list l;
+    const char *page_name[] = { "normal", "huge" };
+    const char *mode_name[] = { "sync", "queued" };
+
+    switch (opt){
+    case 'd': devarg = optarg; break;
+    case 's': if (parse_list(optarg, &sizes))   usage(); break;
+    case 'a': if (parse_list(optarg, &aligns))  usage(); break;
+    case 'p': if (parse_names(optarg, page_name, 2, &pages)) usage(); break;
+    case 'j': if (parse_list(optarg, &threads)) usage(); break;
+    case 'w': if (parse_names(optarg, wait_name, 3, &waits)) usage(); break;
+    case 'm': if (parse_names(optarg, mode_name, 2, &modes)) usage(); break;
+    case 'q': depth = atoi(optarg); break;
+    case 't': secs = atof(optarg); break;
+    case 'n': min_ops = strtoul(optarg, NULL, 0); break;
+    case 'f':
+      if (parse_names(optarg, fmt_name, 3, &l) || l.n != 1) usage();
+      fmt = l.v[0];
+      break;
+    case 'V': verify = 1; break;
+    case 'F': fault_check = 1; break;
+    default: usage();
+    }
+  }
+  if (depth < 1 || depth > MAX_DEPTH || secs < 0) usage();
+  for (a=0; a<aligns.n; a++)
+    if (aligns.v[a] & 3) usage(); // the DMA moves 32-bit words
+  for (s=0; s<sizes.n; s++)
+    if (sizes.v[s] == 0 || (sizes.v[s] & 3)) usage();
+  for (j=0; j<threads.n; j++)
+    if (threads.v[j] < 1 || threads.v[j] > 1024) usage();
+
+  if (devarg == NULL) devarg = "/dev/zfifo0";
+  for (devarg = strtok(devarg, ","); devarg && ndevs < MAX_LIST;
+       devarg = strtok(NULL, ","))
+    devs[ndevs++] = devarg;
+  for (j=0; j<ndevs; j++){
+    int fd = open(devs[j], O_RDWR);
+
+    if (fd < 0){
+      fprintf(stderr, "zfifo-bench: can't open %s: %s\n", devs[j],
+              strerror(errno));
+      return 1;
+    }
+    close(fd);
+  }
+  for (j=0; j<ndevs; j++)
+    if (sysfs_read(devs[j], "wait_policy", saved_wait[j],
+                   sizeof(saved_wait[j])) != 0)
+      saved_wait[j][0] = '\0';
+
+  // the emulated DMA (make EMU=1) has emu_* module parameters
+  backend = (access("/sys/module/zfifo/parameters/emu_mode", F_OK) == 0) ?
+    "emu" : "hw";
+
+  for (j=0; fault_check && j<ndevs; j++)
+    if (check_tx_fault(devs[j]) != 0) failed = 1;
+
+  print_header(backend);
+  for (w=0; w<waits.n; w++){
+    if (waits.v[w] != WAIT_KEEP && set_wait(waits.v[w]) != 0){
+      failed = 1;
+      continue;
+    }
+    for (m=0; m<modes.n; m++)
+      for (p=0; p<pages.n; p++)
+        for (j=0; j<threads.n; j++)
+          for (a=0; a<aligns.n; a++)
+            for (s=0; s<sizes.n; s++){
+              bench_conf c = { sizes.v[s], aligns.v[a], pages.v[p],
+                               threads.v[j], waits.v[w], modes.v[m] };
+              bench_result r;
+
+              if (run_point(&c, &r) != 0 && r.errors == 0)
+                continue; // no huge pages
+              print_result(&c, &r);
+              if (r.errors || r.bad) failed = 1;
+            }
+  }
+  print_footer();
+
+  for (j=0; j<ndevs; j++)
+    if (saved_wait[j][0] != '\0')
+      sysfs_write(devs[j], "wait_policy", saved_wait[j]);
+  return failed;
+}
@@ -6,6 +6,7 @@
 
 #include <linux/cdev.h>
 #include <linux/clk.h>
+#include <linux/debugfs.h>
 #include <linux/dma-mapping.h>
 #include <linux/fs.h>
 #include <linux/idr.h>
@@ -34,12 +35,26 @@
 #include <linux/list.h>
 #include <linux/spinlock.h>
 #include <linux/version.h>
+#include <linux/poll.h>
+#include <linux/eventfd.h>
+#include <linux/workqueue.h>
+#include <linux/uio.h>
+#include <linux/delay.h>
+#include <linux/kthread.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/mmu_notifier.h>
+#include <linux/highmem.h>
+#include <linux/seq_file.h>
 #include <asm/page.h>
 #include <asm/byteorder.h>
 
 #define _ZFIFO_DRIVER_
 #include "zfifo.h"
 
+#define CREATE_TRACE_POINTS
+#include "zfifo_trace.h"
+
 MODULE_DESCRIPTION("User space zero-copy AXI SG-DMA driver");
 MODULE_AUTHOR("osana");
 MODULE_LICENSE("Dual BSD/GPL");
@@ -66,19 +81,44 @@ MODULE_LICENSE("Dual BSD/GPL");
 #define DMACR_RS      (1u<<0)
 #define DMACR_RESET   (1u<<2)
 #define DMACR_IOC_Irq (1u<<12)
+#define DMACR_Dly_Irq (1u<<13)
+#define DMACR_Err_Irq (1u<<14)
+#define DMACR_IRQThreshold(x) (((x) & 0xFF)<<16)
+#define DMACR_IRQDelay(x)     (((x) & 0xFF)<<24)
 #define DMASR_HALTED  (1u<<0)
 #define DMASR_IDLE    (1u<<1)
 #define DMASR_IOC_Irq (1u<<12)
+#define DMASR_Dly_Irq (1u<<13)
 #define DMASR_ERR_Irq (1u<<14)
+#define DMASR_IRQ_MASK (DMASR_IOC_Irq | DMASR_Dly_Irq | DMASR_ERR_Irq)
+#define DMASR_ERR_MASK 0x770  // {SG,DMA}{Dec,Slv,Int}Err
+
+// Channel-relative register offsets (from MM2S_DMACR or S2MM_DMACR)
+#define CH_DMACR       0
+#define CH_DMASR       1
+#define CH_CURDESC     2
+#define CH_CURDESC_H   3
+#define CH_TAILDESC    4
+#define CH_TAILDESC_H  5
+
+// SG descriptor control word
+#define DESC_CTRL_SOF  (1u<<27)
+#define DESC_CTRL_EOF  (1u<<26)
+#define DESC_LEN_MASK  0x03FFFFFF // up to 26 bits (sg length width)
+
+// SG descriptor status word
+#define DESC_STS_CMPLT (1u<<31)
+#define DESC_STS_ERR   (7u<<28)
+#define DESC_STS_RXEOF (1u<<26)
 
 static struct class*  zfifo_sys_class = NULL;
 static unsigned desc_size = 1100*1024; // descriptor space
 static unsigned dma_reg_size = 128;    // AXI DMA register space size
-static const int dmac_buf_bits = 20;   // # bits of DMAC buffer counter
+static const int dmac_buf_bits = 20;   // default # bits of DMAC buffer counter
 
 #define LOW32(x) (x & 0xFFFFFFFF)
 
-#ifdef __aarch64__
+#if defined(__aarch64__) || defined(__x86_64__) // x86_64: ZFIFO_EMU
 // ------------------------------
 #define HIGH32(x) ((x>>32) & 0xFFFFFFFF)
 // ------------------------------
@@ -92,6 +132,142 @@ static int        info_enable = 1;
 module_param(     info_enable , int, S_IRUGO);
 MODULE_PARM_DESC( info_enable , "zfifo install/uninstall infomation enable");
 
+static int        irq_threshold = 1;
+module_param(     irq_threshold , int, S_IRUGO);
+MODULE_PARM_DESC( irq_threshold , "# of completions per interrupt (1-255)");
+
+static int        irq_delay = 0;
+module_param(     irq_delay , int, S_IRUGO);
+MODULE_PARM_DESC( irq_delay , "interrupt delay timeout (0-255, x125 SG clocks)");
+
+static int        wait_policy = 2;
+module_param(     wait_policy , int, S_IRUGO);
+MODULE_PARM_DESC( wait_policy , "completion wait: 0 poll, 1 sleep, 2 poll then sleep");
+
+static int        poll_us = 50;
+module_param(     poll_us , int, S_IRUGO);
+MODULE_PARM_DESC( poll_us , "max busy-poll time (us) before sleeping");
+
+static int        ring_mode = 0;
+module_param(     ring_mode , int, S_IRUGO);
+MODULE_PARM_DESC( ring_mode , "keep DMA channels running, descriptors in a ring");
+
+static unsigned   rxring_slots = 64;
+module_param(     rxring_slots , uint, S_IRUGO);
+MODULE_PARM_DESC( rxring_slots , "# of receive ring slots (mmap)");
+
+static unsigned   rxring_slot_size = 65536;
+module_param(     rxring_slot_size , uint, S_IRUGO);
+MODULE_PARM_DESC( rxring_slot_size , "receive ring slot size (bytes)");
+
+static unsigned   bounce_threshold = 512;
+module_param(     bounce_threshold , uint, S_IRUGO);
+MODULE_PARM_DESC( bounce_threshold , "copy transfers up to this size through the bounce pool");
+
+static unsigned   bounce_slots = 16;
+module_param(     bounce_slots , uint, S_IRUGO);
+MODULE_PARM_DESC( bounce_slots , "# of bounce buffers per channel (up to BITS_PER_LONG)");
+
+static unsigned   bounce_size = 4096;
+module_param(     bounce_size , uint, S_IRUGO);
+MODULE_PARM_DESC( bounce_size , "bounce buffer size, the max bounce_threshold");
+
+static int        defer_unpin = 0;
+module_param(     defer_unpin , int, S_IRUGO);
+MODULE_PARM_DESC( defer_unpin , "unmap and unpin user buffers on a workqueue after completion");
+
+static unsigned   chunk_size = 16*1024*1024;
+module_param(     chunk_size , uint, S_IRUGO);
+MODULE_PARM_DESC( chunk_size , "send/recv larger than this go in pipelined chunks, 0: off");
+
+static unsigned   pin_cache_pages = 0;
+module_param(     pin_cache_pages , uint, S_IRUGO);
+MODULE_PARM_DESC( pin_cache_pages , "pages kept pinned per file by the pin cache, 0: off");
+
+static int        bypass_enable = 0;
+module_param(     bypass_enable , int, S_IRUGO);
+MODULE_PARM_DESC( bypass_enable , "allow kernel-bypass queues (IOCTL_BYPASS_SETUP)");
+
+static unsigned   bypass_pool_max = 64*1024*1024;
+module_param(     bypass_pool_max , uint, S_IRUGO);
+MODULE_PARM_DESC( bypass_pool_max , "max kernel-bypass buffer pool (bytes)");
+
+static unsigned   bypass_idle_us = 1000;
+module_param(     bypass_idle_us , uint, S_IRUGO);
+MODULE_PARM_DESC( bypass_idle_us , "kernel-bypass thread polls this long before sleeping");
+
+// Per-channel performance counters (ch->lock held), reset through sysfs
+#define ZFIFO_HIST_BUCKETS 24
+typedef struct {
+  u64 transfers, bytes, errors;
+  u64 pages;                // pages pinned
+  u64 sg_ents, descs;       // mapped entries in, descriptors built out
+  u64 pin_ns, map_ns, build_ns, dma_ns, wait_ns, unpin_ns;
+  u64 dropped;              // S2MM: bytes flushed behind a short packet
+  u64 hist[ZFIFO_HIST_BUCKETS]; // transfer latency, [i]: < 2^i us
+  int irq_base;             // irq_events at reset
+} zfifo_perf;
+
+// One AXI DMA channel (MM2S or S2MM) and its descriptor area
+typedef struct {
+  volatile unsigned __iomem *regs;  // channel registers
+  enum dma_data_direction dir;
+  unsigned       irq;
+  atomic_t       irq_events;        // bumped by zfifo_intr()
+  unsigned       dmacr;             // DMACR while running
+  unsigned long long completed;     // # of retired transfers
+  unsigned long  bw;                // measured bytes/us (EWMA)
+  unsigned long long sleeps;        // # of waits that went to sleep
+  unsigned      *desc;
+  dma_addr_t     phys;
+  unsigned       ndesc;             // # of descriptor slots
+  unsigned       head;              // next free slot
+  unsigned       used;              // # of slots in flight
+  int            ring;              // ring mode: never halt, wrap around
+  int            running;
+  unsigned long long next_cookie;
+  struct list_head active;          // submitted, in descriptor order
+  struct list_head done;            // completed, not yet waited for
+  struct mutex   lock;
+  void          *bounce;            // bounce pool, bounce_slots slots
+  dma_addr_t     bounce_dma;
+  unsigned       bounce_slots, bounce_size; // as allocated
+  unsigned long  bounce_map;        // slots in use
+  unsigned long long bounced;       // # of transfers through the pool
+  zfifo_perf     perf;
+  unsigned       last_sr;           // DMASR at the last reap
+  atomic64_t     t_irq;             // ns of the last interrupt
+} zfifo_chan;
+
+// S2MM receive ring (mmap)
+typedef struct {
+  struct file   *owner;
+  zfifo_rxring  *ctl;       // head of the mapping, slots follow
+  dma_addr_t     dma;
+  size_t         size;
+  unsigned       nslots, slot_size;
+  unsigned       prod;      // next slot to complete
+  unsigned       posted;    // slots given to the DMA so far
+  int            error;
+} zfifo_rx_ring;
+
+// Kernel-bypass queues
+typedef struct {
+  void              *dev;       // zfifo_device_data
+  struct file       *owner;
+  zfifo_bypass_ctl  *ctl;       // vmalloc_user()ed, shared with user space
+  size_t             ctl_size;
+  zfifo_bypass_entry *ent[2];   // entry arrays in ctl
+  unsigned           sq_head[2]; // ctl->q[].sq_head, not user writable
+  unsigned           done[2];   // entries the DMA completed, ditto
+  unsigned           depth;
+  void              *pool;
+  dma_addr_t         pool_dma;
+  size_t             pool_size;
+  struct task_struct *thread;
+  int                error;
+} zfifo_bypass;
+
 typedef struct {
   struct device* sys_dev;
   struct device* dma_dev;
@@ -102,13 +278,45 @@ typedef struct {
   volatile unsigned __iomem *dma_regs;
   void          *tx_desc_base, *rx_desc_base;
   dma_addr_t     tx_phys_base,  rx_phys_base;
-  unsigned      *tx_desc, *rx_desc;
-  dma_addr_t     tx_phys, rx_phys;
+  zfifo_chan     mm2s, s2mm;
   unsigned       dmac_buf_len;
-  unsigned       mm2s_irq, s2mm_irq;
-  wait_queue_head_t mm2s_waitq, s2mm_waitq;
+  int            coherent;          // I/O coherent (ACP/HPC): no cache ops
+  unsigned       irq_threshold, irq_delay; // interrupt coalescing
+  unsigned       wait_policy;       // ZFIFO_WAIT_*
+  unsigned       poll_us;
+  wait_queue_head_t waitq;
+  struct list_head evfds;   // completion eventfds per file
+  spinlock_t     evfd_lock;
+  atomic_t       nr_evfd;
+  atomic_t       nr_async;  // kiocbs in flight
+  atomic_t       nr_open;   // open files, -1 while the debugfs bench runs
+  int            dma_error; // a channel halted on error, reset the DMA
+  struct work_struct reap_work; // retires completions for eventfd users
+  unsigned       defer_unpin;       // unmap/unpin by unpin_work
+  struct list_head unpin_list;      // sg_mapping waiting for unpin_work
+  spinlock_t     unpin_lock;
+  atomic_t       nr_unpin;          // # of buffers in unpin_list
+  struct work_struct unpin_work;
+  struct idr     reg_idr;   // registered buffers by handle
+  struct mutex   reg_lock;
+  struct list_head pins;    // pin cache, zfifo_pin
+  struct mutex   pin_lock;
+  unsigned long  pin_pages; // pinned by the cache
+  unsigned long long pin_hits, pin_misses;
+  zfifo_rx_ring *rxring;    // S2MM is dedicated to it while set
+  zfifo_bypass  *bypass;    // both channels are, while set
+  unsigned       rxring_slots, rxring_slot_size;
+  unsigned       bounce_threshold; // copy transfers up to this size
+  struct zfifo_bench *bench; // debugfs benchmark, NULL without debugfs
+#ifdef ZFIFO_EMU
+  struct zfifo_emu *emu;    // emulated AXI DMA behind dma_regs
+#endif
 } zfifo_device_data;
 
+// tracepoint arguments: device minor, 0 for MM2S / 1 for S2MM
+#define ZFIFO_TRACE_MINOR(this) MINOR((this)->device_number)
+#define ZFIFO_TRACE_DIR(dir)    ((dir) != DMA_TO_DEVICE)
+
 // ----------------------------------------------------------------------
 // SG mapping stuff
 
@@ -116,396 +324,3986 @@ typedef struct {
 typedef struct {
   long npages;
   struct page ** pages;
+  int foll_pin;  // pages pinned by pin_user_pages*(), else referenced,
+                 // -1: of a kernel iov_iter, no reference taken
+  struct sg_table sgt; // sgl from sg_alloc_table_from_pages(), if used
   struct scatterlist * sgl;
+  int nsg;    // # of scatterlist entries
   enum dma_data_direction dir;
   unsigned long num_sg;
+  int nents;  // # of DMA mapped scatterlist entries
+  unsigned max_desc; // # of descriptors build_sg_desc() may write
+  u64 pin_ns, map_ns; // time to pin and to map, until accounted
+  unsigned long len;  // bytes mapped
+  int accounted;      // in the channel's perf counters
+  int synced; // the CPU sync on unmap is done already
+  struct list_head list; // unpin_list
   zfifo_device_data* dev;
 } sg_mapping;
 
-static void release_pinned(struct page **pages, long npages){
+static void release_pinned(struct page **pages, long npages,
+                           int foll_pin, int dirty){
   int i;
+
+  if (foll_pin < 0) return; // the owner of the kernel iov_iter holds them
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,6,0)
+  if (foll_pin){
+    unpin_user_pages_dirty_lock(pages, npages, dirty);
+    return;
+  }
+#endif
   for(i=0; i<npages; i++)
     put_page(pages[i]);
 }
 
+// Largest length of one descriptor, kept 64-byte aligned when split
+static inline unsigned desc_max_len(zfifo_device_data* this){
+  return this->dmac_buf_len & ~63u;
+}
+
+// Descriptors build_sg_desc() writes at most for a mapped sg_map (without
+// frames): DMA segments longer than a descriptor are split
+static unsigned sg_desc_bound(zfifo_device_data* this, sg_mapping *sg_map){
+  struct scatterlist *sg;
+  unsigned n = 0;
+  int i;
+
+  for_each_sg(sg_map->sgl, sg, sg_map->nents, i)
+    n += DIV_ROUND_UP(sg_dma_len(sg), desc_max_len(this));
+  return n;
+}
 
+// Pin a user buffer with FOLL_LONGTERM and map it. Physically contiguous
+// pages (huge pages, folios) are coalesced into one scatterlist entry.
 static sg_mapping *alloc_sg_buf(zfifo_device_data* this,
                                 char __user *bufp, unsigned long len,
-                                enum dma_data_direction dir,
-                                volatile unsigned *sg_desc, dma_addr_t sg_phys){
+                                enum dma_data_direction dir){
   sg_mapping *sg_map = NULL;
   struct page **pages = NULL;
-  struct scatterlist * sgl;
-  struct scatterlist * sg;
 
   unsigned long npages_req = 0;
   unsigned long udata = (unsigned long) bufp;
+  unsigned gup_flags = (dir != DMA_TO_DEVICE) ? FOLL_WRITE : 0;
   long npages = 0;
-  int i;
-
-  unsigned long len_rem = len;
-  unsigned fp_offset; // first page offset
-  unsigned long num_sg;
+  int foll_pin = 0;
+  int nents;
+  ktime_t t0 = ktime_get(), t1;
 
-  unsigned d;
-  
   npages_req = ((udata + len - 1)>>PAGE_SHIFT) - (udata>>PAGE_SHIFT) + 1;
     
   // Alloc sg_mapping
-  if ((sg_map = (sg_mapping *)kmalloc(sizeof(*sg_map), GFP_KERNEL)) == NULL){
+  if ((sg_map = (sg_mapping *)kzalloc(sizeof(*sg_map), GFP_KERNEL)) == NULL){
     printk(KERN_ERR "zfifo: could not allocate memory for sg_mapping struct\n");
     return NULL;
   }
 
   // Alloc pages array
-  if ((pages = kmalloc(npages_req * sizeof(*pages), GFP_KERNEL)) == NULL){
+  if ((pages = kvmalloc_array(npages_req, sizeof(*pages), GFP_KERNEL)) == NULL){
     printk(KERN_ERR "zfifo: could not allocate memory for pages array\n");
     kfree(sg_map);
     return NULL;
   }
 
-  // Pin pages
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,8,0)
-  mmap_read_lock(current->mm);
+  // Pin pages, without mmap_lock on the fast path
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,6,0)
+  npages = pin_user_pages_fast(udata, npages_req,
+                               gup_flags | FOLL_LONGTERM, pages);
+  foll_pin = 1;
 #else
-  down_read(&current->mm->mmap_sem);
-#endif
-
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,5,0)
-  npages = get_user_pages(udata, npages_req,
-                          ((dir==DMA_FROM_DEVICE) ? FOLL_WRITE : 0), pages);
-#else 
-  npages = get_user_pages(udata, npages_req,
-                          ((dir==DMA_FROM_DEVICE) ? FOLL_WRITE : 0),
-                          pages, NULL);
+  npages = get_user_pages_fast(udata, npages_req, gup_flags, pages);
 #endif
+  t1 = ktime_get();
+  trace_zfifo_pin(ZFIFO_TRACE_MINOR(this), ZFIFO_TRACE_DIR(dir), len, npages);
 
-  if (npages <= 0){
-    printk(KERN_ERR "zfifo: unable to pin any pages in memory\n");
-    kfree(pages);
+  if (npages != npages_req){
+    printk(KERN_ERR "zfifo: unable to pin the user buffer in memory\n");
+    if (npages > 0) release_pinned(pages, npages, foll_pin, 0);
+    kvfree(pages);
     kfree(sg_map);
     return NULL;
   }
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,8,0)
-  mmap_read_unlock(current->mm);
-#else
-  up_read(&current->mm->mmap_sem);
-#endif
-
-  // Create scatterlist array
-  if ((sgl = kcalloc(npages, sizeof(*sgl), GFP_KERNEL)) == NULL) {
+  // Scatterlist of contiguous runs
+  if (sg_alloc_table_from_pages(&sg_map->sgt, pages, npages,
+                                udata & ~PAGE_MASK, len, GFP_KERNEL)){
     printk(KERN_ERR "zfifo: could not allocate memory for scatterlist array\n");
-    release_pinned(pages, npages);
-    kfree(pages);
+    release_pinned(pages, npages, foll_pin, 0);
+    kvfree(pages);
     kfree(sg_map);
     return NULL;
   }
 
-  // Fill scatterlist array
-  fp_offset = (udata & (~PAGE_MASK));
-  sg_init_table(sgl, npages);
-  for (i=0; i<npages; i++){
-    unsigned page_len;
-    page_len = ((fp_offset+len_rem) > PAGE_SIZE ? (PAGE_SIZE-fp_offset) :
-                len_rem);
-    sg_set_page(&sgl[i], pages[i], page_len, fp_offset);
-
-    // printk("SG List [%d], offset 0x%x, page_len %d, %ld to go\n",
-    //        i, fp_offset, page_len, len_rem);
-
-    len_rem -= page_len;
-    fp_offset = 0; // no offset for 2nd and later pages
-  }
-
   // Finalize scatterlist array and get DMA addresses
-  num_sg = dma_map_sg(this->dma_dev, sgl, npages, dir);
-  //  printk("dma_map_sg done, num=%ld\n", num_sg);
-
-  d=0;
-  for_each_sg(sgl, sg, num_sg, i) {
-    unsigned int hw_len, prev_len;
-    dma_addr_t hw_addr, prev_addr;
-    
-    dma_addr_t next_desc;
-    const unsigned ctrl_sof = 1u << 27;
-    const unsigned ctrl_eof = 1u << 26;
+  nents = dma_map_sg_attrs(this->dma_dev, sg_map->sgt.sgl,
+                           sg_map->sgt.orig_nents, dir,
+                           this->coherent ? DMA_ATTR_SKIP_CPU_SYNC : 0);
+  if (nents == 0){
+    printk(KERN_ERR "zfifo: dma_map_sg failed\n");
+    sg_free_table(&sg_map->sgt);
+    release_pinned(pages, npages, foll_pin, 0);
+    kvfree(pages);
+    kfree(sg_map);
+    return NULL;
+  }
 
-    int merge=0;
+  // Store map properties (to be freed by free_sg_buf() )
+  sg_map->dev      = this;
+  sg_map->dir      = dir;
+  sg_map->npages   = npages;
+  sg_map->pages    = pages;
+  sg_map->foll_pin = foll_pin;
+  sg_map->sgl      = sg_map->sgt.sgl;
+  sg_map->nsg      = sg_map->sgt.orig_nents;
+  sg_map->nents    = nents;
+  sg_map->num_sg   = 0; // set by build_sg_desc()
+  sg_map->synced   = 0;
+  sg_map->max_desc = sg_desc_bound(this, sg_map);
+  sg_map->pin_ns   = ktime_to_ns(ktime_sub(t1, t0));
+  sg_map->map_ns   = ktime_to_ns(ktime_sub(ktime_get(), t1));
+  sg_map->len      = len;
+  trace_zfifo_map(ZFIFO_TRACE_MINOR(this), ZFIFO_TRACE_DIR(dir), len, nents);
+  
+  return sg_map;
+}
 
-    next_desc = sg_phys + (0x40 * (d+1));
-    
-    hw_addr = sg_dma_address(sg);
-    hw_len  = sg_dma_len(sg);
+// Pin the pages of the next contiguous range of iter, up to maxpages,
+// and advance it. Returns bytes, *offset into the first page. User
+// memory is pinned (FOLL_PIN), as alloc_sg_buf() does, for the whole
+// life of the mapping; *foll_pin tells how to release the pages.
+static ssize_t zfifo_iter_pin(struct iov_iter *iter, struct page **pages,
+                              long maxpages, enum dma_data_direction dir,
+                              int *foll_pin, size_t *offset){
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,3,0)
+  *foll_pin = iov_iter_extract_will_pin(iter) ? 1 : -1;
+  return iov_iter_extract_pages(iter, &pages, iov_iter_count(iter),
+                                maxpages, 0, offset);
+#else
+  ssize_t bytes;
 
-    if (i!=0 && i!=num_sg-1){ // decide to merge or not to
-#ifdef __aarch64__
-      prev_addr = ( sg_desc[(d-1)*16 +2] +
-                    (((dma_addr_t)(sg_desc[(d-1)*16+3]))<<32) );
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,6,0)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,0,0)
+  if (user_backed_iter(iter)){
 #else
-      prev_addr = sg_desc[(d-1)*16 +2];
+  if (iter_is_iovec(iter)){
 #endif
-
-      prev_len =  sg_desc[(d-1)*16 +6] & 0x007FFFFF;
-
-      if (hw_addr == prev_addr+prev_len &&
-          (prev_len+hw_len) < this->dmac_buf_len){
-        merge=1;
-        
-        sg_desc[(d-1)*16 +6] =
-          (sg_desc[(d-1)*16 +6] & 0xFF800000) +
-          ((prev_len+hw_len)    & 0x007FFFFF);
-
-        /*
-        printk("SG Merge [%d:%pad], %pad, len=%u (%u)\n",
-               d-1, &sg_phys, &prev_addr, prev_len+hw_len,
-               this->dmac_buf_len);   */
-             
+    // one user segment at a time, long-term like alloc_sg_buf()
+    unsigned gup_flags = (dir != DMA_TO_DEVICE) ? FOLL_WRITE : 0;
+    unsigned long addr;
+    size_t len;
+    long n, got;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,0,0)
+    if (iter_is_ubuf(iter)){
+      addr = (unsigned long)iter->ubuf + iter->iov_offset;
+      len  = iov_iter_count(iter);
+    } else
+#endif
+    {
+      while (iter->iov->iov_len == iter->iov_offset){ // empty segment
+        iter->iov++;
+        iter->nr_segs--;
+        iter->iov_offset = 0;
       }
+      addr = (unsigned long)iter->iov->iov_base + iter->iov_offset;
+      len  = min(iov_iter_count(iter), iter->iov->iov_len - iter->iov_offset);
     }
+    *foll_pin = 1;
+    *offset = addr & ~PAGE_MASK;
+    n   = min_t(long, DIV_ROUND_UP(*offset + len, PAGE_SIZE), maxpages);
+    len = min_t(size_t, len, n * PAGE_SIZE - *offset);
+    got = pin_user_pages_fast(addr & PAGE_MASK, n,
+                              gup_flags | FOLL_LONGTERM, pages);
+    if (got != n){
+      if (got > 0) unpin_user_pages(pages, got);
+      return -EFAULT;
+    }
+    iov_iter_advance(iter, len);
+    return len;
+  }
+#endif
+  // kernel memory (splice): page references
+  *foll_pin = 0;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,0,0)
+  bytes = iov_iter_get_pages2(iter, pages, iov_iter_count(iter),
+                              maxpages, offset);
+#else
+  bytes = iov_iter_get_pages(iter, pages, iov_iter_count(iter),
+                             maxpages, offset);
+  if (bytes > 0) iov_iter_advance(iter, bytes);
+#endif
+  return bytes;
+#endif
+}
 
-    if (merge==0){
-      // not to merge
+// Pin the user pages behind an iov_iter (read/write, readv/writev) and
+// map them as one scatterlist. Segment boundaries become ordinary
+// scatterlist breaks, so a writev is sent as a single packet.
+static sg_mapping *alloc_sg_iter(zfifo_device_data* this,
+                                 struct iov_iter *iter,
+                                 enum dma_data_direction dir){
+  sg_mapping *sg_map = NULL;
+  struct page **pages = NULL;
+  struct scatterlist * sgl = NULL;
+  long npages_req, npages = 0;
+  unsigned long len = iov_iter_count(iter);
+  int foll_pin = 0;
+  int nents;
+  ktime_t t0 = ktime_get(), t1;
+
+  npages_req = iov_iter_npages(iter, INT_MAX);
+  if (npages_req <= 0) return NULL;
+
+  if ((sg_map = kzalloc(sizeof(*sg_map), GFP_KERNEL)) == NULL ||
+      (pages = kvmalloc_array(npages_req, sizeof(*pages), GFP_KERNEL))
+      == NULL ||
+      (sgl = kvmalloc_array(npages_req, sizeof(*sgl), GFP_KERNEL)) == NULL){
+    printk(KERN_ERR "zfifo: could not allocate memory for sg_mapping\n");
+    goto err;
+  }
+  sg_init_table(sgl, npages_req);
+
+  while (iov_iter_count(iter) != 0 && npages < npages_req){
+    size_t offset;
+    ssize_t bytes;
+    long n, i;
+
+    // pages of one contiguous range, FOLL_WRITE for ITER_DEST
+    bytes = zfifo_iter_pin(iter, pages + npages, npages_req - npages, dir,
+                           &foll_pin, &offset);
+    if (bytes <= 0){
+      printk(KERN_ERR "zfifo: unable to pin user pages\n");
+      goto err;
+    }
 
-      /*
-      printk("SG Map [%d:%pad], %pad, next=%pad, len=%u, sof=%d, eof=%d\n",
-             d, &sg_phys,
-             &hw_addr, &next_desc, hw_len,
-             (d==0 ? 1: 0), (i==num_sg-1 ? 1:0)); 
-      */
-      
-      sg_desc[d*16 + 0] = LOW32(next_desc);
-      sg_desc[d*16 + 1] = HIGH32(next_desc);
-      
-      sg_desc[d*16 + 2] = LOW32(hw_addr);
-      sg_desc[d*16 + 3] = HIGH32(hw_addr); 
-      
-      sg_desc[d*16 + 4] =  0; // Reserved
-      sg_desc[d*16 + 5] =  0; // Reserved
-      sg_desc[d*16 + 6] =  ((hw_len         & 0x007FFFFF)   |
-                            ((i==0)        ? ctrl_sof : 0 ) |
-                            ((i==num_sg-1) ? ctrl_eof : 0 )   );
-      sg_desc[d*16 + 7] =  0; // Status
-      d++;
-    } 
+    n = DIV_ROUND_UP(offset + bytes, PAGE_SIZE);
+    for (i=0; i<n; i++){
+      unsigned page_len = min_t(size_t, bytes, PAGE_SIZE - offset);
+      sg_set_page(&sgl[npages + i], pages[npages + i], page_len, offset);
+      bytes -= page_len;
+      offset = 0;
+    }
+    npages += n;
   }
-  
-  // Store map properties (to be freed by free_sg_buf() )
+  sg_mark_end(&sgl[npages - 1]);
+  t1 = ktime_get();
+  trace_zfifo_pin(ZFIFO_TRACE_MINOR(this), ZFIFO_TRACE_DIR(dir), len, npages);
+
+  nents = dma_map_sg_attrs(this->dma_dev, sgl, npages, dir,
+                           this->coherent ? DMA_ATTR_SKIP_CPU_SYNC : 0);
+  if (nents == 0){
+    printk(KERN_ERR "zfifo: dma_map_sg failed\n");
+    goto err;
+  }
+
   sg_map->dev    = this;
   sg_map->dir    = dir;
   sg_map->npages = npages;
   sg_map->pages  = pages;
+  sg_map->foll_pin = foll_pin;
   sg_map->sgl    = sgl;
-  sg_map->num_sg = d; // with merge
+  sg_map->nsg    = npages;
+  sg_map->nents  = nents;
+  sg_map->num_sg = 0;
+  sg_map->synced = 0;
+  sg_map->max_desc = sg_desc_bound(this, sg_map);
+  sg_map->pin_ns = ktime_to_ns(ktime_sub(t1, t0));
+  sg_map->map_ns = ktime_to_ns(ktime_sub(ktime_get(), t1));
+  sg_map->len    = len;
+  trace_zfifo_map(ZFIFO_TRACE_MINOR(this), ZFIFO_TRACE_DIR(dir), len, nents);
 
-  
   return sg_map;
+
+ err:
+  release_pinned(pages, npages, foll_pin, 0);
+  kvfree(sgl);
+  kvfree(pages);
+  kfree(sg_map);
+  return NULL;
 }
 
-static void free_sg_buf(sg_mapping *sg_map){
-  dma_unmap_sg(sg_map->dev->dma_dev, sg_map->sgl, sg_map->npages, sg_map->dir);
-  release_pinned(sg_map->pages, sg_map->npages);
+// Write one descriptor of a chain into slot cur of an nslots ring
+static void write_sg_desc(volatile unsigned *sg_desc, dma_addr_t sg_phys,
+                          unsigned cur, unsigned nslots,
+                          dma_addr_t hw_addr, unsigned ctrl){
+  dma_addr_t next_desc = sg_phys + (0x40 * ((cur+1) % nslots));
+  volatile unsigned *dst = sg_desc + cur*16;
+
+  dst[0] = LOW32(next_desc);
+  dst[1] = HIGH32(next_desc);
+  dst[2] = LOW32(hw_addr);
+  dst[3] = HIGH32(hw_addr);
+  dst[4] = 0; // Reserved
+  dst[5] = 0; // Reserved
+  dst[6] = ctrl;
+  dst[7] = 0; // Status
+}
 
-  kfree(sg_map->sgl);
-  kfree(sg_map->pages);
+// Write the descriptor chain of sg_map into the nslots descriptor ring at
+// sg_desc (DMA address sg_phys) from slot first, merging physically
+// contiguous entries and splitting ones over a descriptor's length. The
+// descriptor under construction is kept in registers and written once,
+// never read back from the (uncached) descriptor area. With frame != 0
+// the buffer is cut into packets of frame bytes: SOF/EOF (TLAST) at
+// every frame boundary, no merge across them. Returns # of descriptors.
+static unsigned build_sg_desc(zfifo_device_data* this, sg_mapping *sg_map,
+                              volatile unsigned *sg_desc, dma_addr_t sg_phys,
+                              unsigned first, unsigned nslots,
+                              unsigned long frame){
+  struct scatterlist * sg;
+  unsigned long num_sg = sg_map->nents;
+  unsigned long pos = 0; // bytes from the head of the buffer
+  unsigned max_len = desc_max_len(this);
+  dma_addr_t cur_addr = 0;  // pending descriptor
+  unsigned   cur_len  = 0, cur_ctrl = 0;
+  unsigned d;
+  int i;
+
+  d=0;
+  for_each_sg(sg_map->sgl, sg, num_sg, i) {
+    dma_addr_t hw_addr = sg_dma_address(sg);
+    unsigned long sg_rem = sg_dma_len(sg);
+
+    while (sg_rem != 0){
+      unsigned long hw_len;
+      int sof, eof;
+
+      hw_len = min_t(unsigned long, sg_rem, max_len);
+      if (frame != 0 && hw_len > frame - pos % frame)
+        hw_len = frame - pos % frame;
+
+      sof = (pos == 0) || (frame != 0 && pos % frame == 0);
+      eof = (i == num_sg-1 && hw_len == sg_rem) ||
+            (frame != 0 && (pos + hw_len) % frame == 0);
+
+      if (cur_len != 0 && !sof && hw_addr == cur_addr + cur_len &&
+          cur_len + hw_len <= max_len){
+        cur_len += hw_len; // merge
+      } else {
+        if (cur_len != 0)
+          write_sg_desc(sg_desc, sg_phys, (first + d++) % nslots, nslots,
+                        cur_addr, cur_ctrl | cur_len);
+        cur_addr = hw_addr;
+        cur_len  = hw_len;
+        cur_ctrl = sof ? DESC_CTRL_SOF : 0;
+      }
+      if (eof) cur_ctrl |= DESC_CTRL_EOF;
+
+      hw_addr += hw_len;
+      sg_rem  -= hw_len;
+      pos     += hw_len;
+    }
+  }
+  if (cur_len != 0)
+    write_sg_desc(sg_desc, sg_phys, (first + d++) % nslots, nslots,
+                  cur_addr, cur_ctrl | cur_len);
+
+  sg_map->num_sg = d; // with merge
+  return d;
+}
+
+static void free_sg_buf(sg_mapping *sg_map){
+  dma_unmap_sg_attrs(sg_map->dev->dma_dev, sg_map->sgl, sg_map->nsg,
+                     sg_map->dir,
+                     (sg_map->synced || sg_map->dev->coherent) ?
+                     DMA_ATTR_SKIP_CPU_SYNC : 0);
+  release_pinned(sg_map->pages, sg_map->npages, sg_map->foll_pin,
+                 sg_map->dir != DMA_TO_DEVICE);
+
+  if (sg_map->sgt.sgl != NULL)
+    sg_free_table(&sg_map->sgt);
+  else
+    kvfree(sg_map->sgl); // kvmalloc'ed (alloc_sg_iter)
+  kvfree(sg_map->pages);
+  trace_zfifo_unpin(ZFIFO_TRACE_MINOR(sg_map->dev),
+                    ZFIFO_TRACE_DIR(sg_map->dir), sg_map->len, sg_map->npages);
   kfree(sg_map);
 }
 
+// Cache maintenance on the first len bytes only
+static void sync_sg_buf(zfifo_device_data* this, sg_mapping *sg_map,
+                        unsigned long len, int for_device){
+  struct scatterlist *sg;
+  int i;
+
+  if (this->coherent) return; // the interconnect keeps caches coherent
+
+  for_each_sg(sg_map->sgl, sg, sg_map->nents, i){
+    unsigned long l;
+    if (len == 0) break;
+    l = (sg_dma_len(sg) < len) ? sg_dma_len(sg) : len;
+
+    if (for_device)
+      dma_sync_single_for_device(this->dma_dev, sg_dma_address(sg), l,
+                                 sg_map->dir);
+    else
+      dma_sync_single_for_cpu(this->dma_dev, sg_dma_address(sg), l,
+                              sg_map->dir);
+    len -= l;
+  }
+}
+
+static void zfifo_unpin_work(struct work_struct *work){
+  zfifo_device_data* this = container_of(work, zfifo_device_data, unpin_work);
+  sg_mapping *sg_map, *tmp;
+  LIST_HEAD(list);
+
+  spin_lock(&this->unpin_lock);
+  list_splice_init(&this->unpin_list, &list);
+  spin_unlock(&this->unpin_lock);
+
+  list_for_each_entry_safe(sg_map, tmp, &list, list){
+    list_del(&sg_map->list);
+    free_sg_buf(sg_map);
+    atomic_dec(&this->nr_unpin);
+  }
+}
 
+// Release a buffer after its transfer, in the background if defer_unpin.
+// Only the len bytes the CPU reads next are synced for a receive here.
+static void free_sg_buf_deferred(zfifo_device_data* this,
+                                 sg_mapping *sg_map, unsigned long len){
+  if (!this->defer_unpin){
+    free_sg_buf(sg_map);
+    return;
+  }
+  if (sg_map->dir != DMA_TO_DEVICE && !sg_map->synced)
+    sync_sg_buf(this, sg_map, len, 0);
+  sg_map->synced = 1;
+
+  spin_lock(&this->unpin_lock);
+  list_add_tail(&sg_map->list, &this->unpin_list);
+  spin_unlock(&this->unpin_lock);
+  atomic_inc(&this->nr_unpin);
+  schedule_work(&this->unpin_work);
+}
 
 // ----------------------------------------------------------------------
-// Send/Recv
+// Registered buffers: pinned, mapped and described once, used by handle
 
-static int zfifo_recv(zfifo_device_data* this,
-                      char __user *bufp, unsigned long len){
-  sg_mapping *sg_map;
-  dma_addr_t head, tail;
-  unsigned intr_en;
-  DEFINE_WAIT(wait);
-  
-  sg_map = alloc_sg_buf(this, bufp, len, DMA_FROM_DEVICE,
-                        this->rx_desc, this->rx_phys);
+typedef struct {
+  sg_mapping    *sg_map;
+  struct file   *owner;      // NULL: closed while busy, freed on completion
+  unsigned long  len;
+  int            flags;
+  int            busy;
+  unsigned      *desc;       // prebuilt descriptor chain (cached shadow)
+} zfifo_reg_buf;
+
+static void zfifo_reg_free(zfifo_device_data* this, zfifo_reg_buf *rb){
+  free_sg_buf(rb->sg_map);
+  kfree(rb->desc);
+  kfree(rb);
+}
 
-  head = this->rx_phys;
-  tail = this->rx_phys + (0x40 * (sg_map->num_sg-1));
-  intr_en = (this->s2mm_irq != 0) ? DMACR_IOC_Irq : 0;
-  
-  this->dma_regs[S2MM_CURDESC   ] = LOW32 (head);
-  this->dma_regs[S2MM_CURDESC_H ] = HIGH32(head);
-  this->dma_regs[S2MM_DMACR     ] = DMACR_RS | intr_en;
-  this->dma_regs[S2MM_TAILDESC  ] = LOW32 (tail);
-  this->dma_regs[S2MM_TAILDESC_H] = HIGH32(tail);
-
-#ifdef DEBUG_ZFIFO  
-  dev_dbg(this->sys_dev,
-          "Recv DMA regs=%pa user=%pa, len=%ld, head=%pad, tail=%pad\n",
-          &this->dma_regs_phys, &bufp, len, &head, &tail);
-#endif
+// Pin, map and describe the whole of a user buffer
+static zfifo_reg_buf *zfifo_reg_buf_alloc(zfifo_device_data* this,
+                                          char __user *bufp, unsigned long len,
+                                          enum dma_data_direction dir){
+  zfifo_reg_buf *rb;
+  unsigned long udata = (unsigned long) bufp;
+  unsigned long npages_req;
+
+  if ((rb = kzalloc(sizeof(*rb), GFP_KERNEL)) == NULL)
+    return ERR_PTR(-ENOMEM);
 
-  if (this->s2mm_irq != 0){ // wait for interrupt if enabled
-    prepare_to_wait(&this->s2mm_waitq, &wait, TASK_INTERRUPTIBLE);
-    schedule(); // or maybe schedule_timeout()
-    finish_wait(&this->s2mm_waitq, &wait);
+  rb->sg_map = alloc_sg_buf(this, bufp, len, dir);
+  if (rb->sg_map == NULL){
+    kfree(rb);
+    return ERR_PTR(-ENOMEM);
   }
-  
-  // wait 
-  while( ~this->dma_regs[S2MM_DMASR] & DMASR_IOC_Irq ){};
-  this->dma_regs[S2MM_DMASR] = (DMASR_IOC_Irq | DMASR_ERR_Irq);
 
-  this->dma_regs[S2MM_DMACR] = 0;
-  
-  free_sg_buf(sg_map);
+  npages_req = ((udata + len - 1)>>PAGE_SHIFT) - (udata>>PAGE_SHIFT) + 1;
+  if (rb->sg_map->npages != npages_req){
+    printk(KERN_ERR "zfifo: could not pin the whole buffer\n");
+    free_sg_buf(rb->sg_map);
+    kfree(rb);
+    return ERR_PTR(-EFAULT);
+  }
+
+  // at most one descriptor per mapped entry; copied to the channel on use
+  rb->desc = kmalloc_array(rb->sg_map->max_desc, 0x40, GFP_KERNEL);
+  if (rb->desc == NULL){
+    free_sg_buf(rb->sg_map);
+    kfree(rb);
+    return ERR_PTR(-ENOMEM);
+  }
+  build_sg_desc(this, rb->sg_map, rb->desc, 0, 0, rb->sg_map->max_desc, 0);
+  rb->len = len;
+
+  return rb;
+}
+
+static int zfifo_reg_buf_create(zfifo_device_data* this, struct file *file,
+                                char __user *bufp, unsigned long len,
+                                int flags){
+  zfifo_reg_buf *rb;
+  enum dma_data_direction dir;
+  int handle;
+
+  switch (flags & (ZFIFO_REG_SEND | ZFIFO_REG_RECV)){
+  case ZFIFO_REG_SEND: dir = DMA_TO_DEVICE;     break;
+  case ZFIFO_REG_RECV: dir = DMA_FROM_DEVICE;   break;
+  case ZFIFO_REG_SEND | ZFIFO_REG_RECV:
+                       dir = DMA_BIDIRECTIONAL; break;
+  default:
+    return -EINVAL;
+  }
+
+  rb = zfifo_reg_buf_alloc(this, bufp, len, dir);
+  if (IS_ERR(rb)) return PTR_ERR(rb);
+
+  rb->owner = file;
+  rb->flags = flags;
+
+  mutex_lock(&this->reg_lock);
+  handle = idr_alloc(&this->reg_idr, rb, 0, 0, GFP_KERNEL);
+  mutex_unlock(&this->reg_lock);
+
+  if (handle < 0)
+    zfifo_reg_free(this, rb);
+
+  return handle;
+}
+
+static int zfifo_reg_buf_destroy(zfifo_device_data* this, struct file *file,
+                                 int handle){
+  zfifo_reg_buf *rb;
+
+  mutex_lock(&this->reg_lock);
+  rb = idr_find(&this->reg_idr, handle);
+  if (rb == NULL || rb->owner != file){
+    mutex_unlock(&this->reg_lock);
+    return -ENOENT;
+  }
+  if (rb->busy){
+    mutex_unlock(&this->reg_lock);
+    return -EBUSY;
+  }
+  idr_remove(&this->reg_idr, handle);
+  mutex_unlock(&this->reg_lock);
+
+  zfifo_reg_free(this, rb);
   return 0;
 }
 
+// Take a registered buffer for one transfer
+static zfifo_reg_buf *zfifo_reg_buf_get(zfifo_device_data* this,
+                                        struct file *file, int handle,
+                                        enum dma_data_direction dir){
+  zfifo_reg_buf *rb;
+  int need = (dir == DMA_TO_DEVICE) ? ZFIFO_REG_SEND : ZFIFO_REG_RECV;
+
+  mutex_lock(&this->reg_lock);
+  rb = idr_find(&this->reg_idr, handle);
+  if (rb == NULL || rb->owner != file || !(rb->flags & need)){
+    mutex_unlock(&this->reg_lock);
+    return ERR_PTR(-EINVAL);
+  }
+  if (rb->busy){
+    mutex_unlock(&this->reg_lock);
+    return ERR_PTR(-EBUSY);
+  }
+  rb->busy = 1;
+  mutex_unlock(&this->reg_lock);
+  return rb;
+}
 
-static int zfifo_send(zfifo_device_data* this,
-                      char __user *bufp, unsigned long len){
-  sg_mapping *sg_map;
-  dma_addr_t head, tail;
-  unsigned intr_en;
-  DEFINE_WAIT(wait);
-  
-  sg_map = alloc_sg_buf(this, bufp, len, DMA_TO_DEVICE,
-                        this->tx_desc, this->tx_phys);
+static void zfifo_reg_buf_put(zfifo_device_data* this, zfifo_reg_buf *rb){
+  int orphan;
+  int handle;
+  zfifo_reg_buf *p;
+
+  mutex_lock(&this->reg_lock);
+  rb->busy = 0;
+  orphan = (rb->owner == NULL);
+  if (orphan){
+    idr_for_each_entry(&this->reg_idr, p, handle){
+      if (p == rb){
+        idr_remove(&this->reg_idr, handle);
+        break;
+      }
+    }
+  }
+  mutex_unlock(&this->reg_lock);
+
+  if (orphan){
+    // a receive was synced by zfifo_req_complete()
+    rb->sg_map->synced = 1;
+    free_sg_buf_deferred(this, rb->sg_map, 0);
+    kfree(rb->desc);
+    kfree(rb);
+  }
+}
 
-  head = this->tx_phys;
-  tail = this->tx_phys + (0x40 * (sg_map->num_sg-1));
-  intr_en = (this->mm2s_irq != 0) ? DMACR_IOC_Irq : 0;
+// Drop every registration made through this file (on close)
+static void zfifo_reg_buf_release_all(zfifo_device_data* this,
+                                      struct file *file){
+  zfifo_reg_buf *rb;
+  int handle;
+
+  mutex_lock(&this->reg_lock);
+  idr_for_each_entry(&this->reg_idr, rb, handle){
+    if (rb->owner != file) continue;
+    if (rb->busy){
+      rb->owner = NULL; // still in flight, freed by zfifo_reg_buf_put()
+    } else {
+      idr_remove(&this->reg_idr, handle);
+      zfifo_reg_free(this, rb);
+    }
+  }
+  mutex_unlock(&this->reg_lock);
+}
 
-  this->dma_regs[MM2S_CURDESC   ] = LOW32 (head);
-  this->dma_regs[MM2S_CURDESC_H ] = HIGH32(head);
-  this->dma_regs[MM2S_DMACR     ] = DMACR_RS | intr_en;
-  this->dma_regs[MM2S_TAILDESC  ] = LOW32 (tail);
-  this->dma_regs[MM2S_TAILDESC_H] = HIGH32(tail);
+// ----------------------------------------------------------------------
+// Pin cache: plain send/recv buffers stay pinned, mapped and described
+// after the transfer, kept LRU per file and dropped when the range is
+// unmapped or remapped (MMU notifier). Charged to RLIMIT_MEMLOCK.
 
-#ifdef DEBUG_ZFIFO
-  dev_dbg(this->sys_dev,
-          "Send DMA regs=%pa user=%pa, len=%ld, head=%pad, tail=%pad\n",
-          &this->dma_regs_phys, &bufp, len, &head, &tail);
-#endif
-  
-  if (this->mm2s_irq != 0){ // wait for interrupt if enabled
-#ifdef DEBUG_ZFIFO
-    dev_dbg(this->sys_dev,
-            "MM2S intr mode: sleeping\n");
+#if defined(CONFIG_MMU_NOTIFIER) && \
+    LINUX_VERSION_CODE >= KERNEL_VERSION(5,10,0)
+#define ZFIFO_PIN_CACHE
 #endif
-    prepare_to_wait(&this->mm2s_waitq, &wait, TASK_INTERRUPTIBLE);
-    schedule(); // or maybe schedule_timeout()
-#ifdef DEBUG_ZFIFO
-    dev_dbg(this->sys_dev,
-            "MM2S intr mode: good morning.\n");
+
+typedef struct {
+  struct list_head   list;      // this->pins, most recently used first
+  struct mmu_interval_notifier notifier;
+  unsigned long      seq;       // notifier sequence when pinned
+  struct file       *owner;
+  struct mm_struct  *mm;
+  unsigned long      start, len;
+  enum dma_data_direction dir;
+  zfifo_reg_buf     *rb;        // owner NULL once dropped while busy
+} zfifo_pin;
+
+#ifdef ZFIFO_PIN_CACHE
+
+static bool zfifo_pin_invalidate(struct mmu_interval_notifier *mni,
+                                 const struct mmu_notifier_range *range,
+                                 unsigned long cur_seq){
+  // the entry goes stale; zfifo_pin_get() drops it on the next lookup
+  mmu_interval_set_seq(mni, cur_seq);
+  return true;
+}
+
+static const struct mmu_interval_notifier_ops zfifo_pin_ops = {
+  .invalidate = zfifo_pin_invalidate,
+};
+
+// Drop a cache entry that is off the list
+static void zfifo_pin_free(zfifo_device_data* this, zfifo_pin *pin){
+  zfifo_reg_buf *rb = pin->rb;
+  int busy;
+
+  mmu_interval_notifier_remove(&pin->notifier);
+  account_locked_vm(pin->mm, rb->sg_map->npages, false);
+
+  mutex_lock(&this->reg_lock);
+  busy = rb->busy;
+  rb->owner = NULL; // freed by zfifo_reg_buf_put() if in flight
+  mutex_unlock(&this->reg_lock);
+  if (!busy)
+    zfifo_reg_free(this, rb);
+  kfree(pin);
+}
+
+static void zfifo_pin_free_list(zfifo_device_data* this,
+                                struct list_head *head){
+  zfifo_pin *pin, *tmp;
+
+  list_for_each_entry_safe(pin, tmp, head, list){
+    list_del(&pin->list);
+    zfifo_pin_free(this, pin);
+  }
+}
+
+// Cached buffer for exactly (bufp, len, dir) of this file, taken for one
+// transfer, or NULL
+static zfifo_reg_buf *zfifo_pin_get(zfifo_device_data* this,
+                                    struct file *file,
+                                    char __user *bufp, unsigned long len,
+                                    enum dma_data_direction dir){
+  zfifo_pin *pin, *tmp;
+  zfifo_reg_buf *rb = NULL;
+  LIST_HEAD(stale);
+
+  mutex_lock(&this->pin_lock);
+  list_for_each_entry_safe(pin, tmp, &this->pins, list){
+    if (pin->owner != file || pin->mm != current->mm) continue;
+    if (mmu_interval_check_retry(&pin->notifier, pin->seq)){
+      this->pin_pages -= pin->rb->sg_map->npages;
+      list_move(&pin->list, &stale);
+      continue;
+    }
+    if (pin->start != (unsigned long)bufp || pin->len != len ||
+        pin->dir != dir) continue;
+
+    mutex_lock(&this->reg_lock);
+    if (!pin->rb->busy){
+      pin->rb->busy = 1;
+      rb = pin->rb;
+    }
+    mutex_unlock(&this->reg_lock);
+    if (rb != NULL)
+      list_move(&pin->list, &this->pins);
+    break;
+  }
+  if (rb != NULL)
+    this->pin_hits++;
+  else
+    this->pin_misses++;
+  mutex_unlock(&this->pin_lock);
+
+  zfifo_pin_free_list(this, &stale);
+  return rb;
+}
+
+// Pin (bufp, len, dir) for one transfer and keep it in the cache,
+// evicting the least recently used entries of the file over
+// pin_cache_pages. A range that cannot be cached is returned orphaned,
+// to be freed on completion.
+static zfifo_reg_buf *zfifo_pin_add(zfifo_device_data* this,
+                                    struct file *file,
+                                    char __user *bufp, unsigned long len,
+                                    enum dma_data_direction dir){
+  zfifo_pin *pin, *tmp;
+  zfifo_reg_buf *rb;
+  unsigned long npages, owned = 0;
+  LIST_HEAD(evict);
+
+  if ((pin = kzalloc(sizeof(*pin), GFP_KERNEL)) == NULL)
+    return ERR_PTR(-ENOMEM);
+
+  // watch the range before pinning so that no invalidation is missed
+  if (mmu_interval_notifier_insert(&pin->notifier, current->mm,
+                                   (unsigned long)bufp, len,
+                                   &zfifo_pin_ops)){
+    kfree(pin);
+    return NULL;
+  }
+  pin->seq = mmu_interval_read_begin(&pin->notifier);
+
+  rb = zfifo_reg_buf_alloc(this, bufp, len, dir);
+  if (IS_ERR(rb)){
+    mmu_interval_notifier_remove(&pin->notifier);
+    kfree(pin);
+    return rb;
+  }
+  rb->busy = 1;
+  npages = rb->sg_map->npages;
+
+  if (npages > pin_cache_pages ||
+      mmu_interval_check_retry(&pin->notifier, pin->seq) ||
+      account_locked_vm(current->mm, npages, true)){
+    mmu_interval_notifier_remove(&pin->notifier);
+    kfree(pin);
+    return rb; // owner NULL: not cached
+  }
+
+  pin->owner = file;
+  pin->mm    = current->mm;
+  pin->start = (unsigned long)bufp;
+  pin->len   = len;
+  pin->dir   = dir;
+  pin->rb    = rb;
+  rb->owner  = file;
+
+  mutex_lock(&this->pin_lock);
+  list_add(&pin->list, &this->pins);
+  this->pin_pages += npages;
+  list_for_each_entry_safe(pin, tmp, &this->pins, list){
+    unsigned long n = pin->rb->sg_map->npages;
+    if (pin->owner != file) continue;
+    if (owned + n <= pin_cache_pages){
+      owned += n;
+    } else {
+      this->pin_pages -= n;
+      list_move(&pin->list, &evict);
+    }
+  }
+  mutex_unlock(&this->pin_lock);
+
+  zfifo_pin_free_list(this, &evict);
+  return rb;
+}
+
+// Drop every cache entry of this file (on close)
+static void zfifo_pin_release_all(zfifo_device_data* this,
+                                  struct file *file){
+  zfifo_pin *pin, *tmp;
+  LIST_HEAD(evict);
+
+  mutex_lock(&this->pin_lock);
+  list_for_each_entry_safe(pin, tmp, &this->pins, list){
+    if (pin->owner != file) continue;
+    this->pin_pages -= pin->rb->sg_map->npages;
+    list_move(&pin->list, &evict);
+  }
+  mutex_unlock(&this->pin_lock);
+
+  zfifo_pin_free_list(this, &evict);
+}
+
+#else // !ZFIFO_PIN_CACHE
+
+static zfifo_reg_buf *zfifo_pin_get(zfifo_device_data* this,
+                                    struct file *file,
+                                    char __user *bufp, unsigned long len,
+                                    enum dma_data_direction dir){
+  return NULL;
+}
+
+static zfifo_reg_buf *zfifo_pin_add(zfifo_device_data* this,
+                                    struct file *file,
+                                    char __user *bufp, unsigned long len,
+                                    enum dma_data_direction dir){
+  return NULL;
+}
+
+static void zfifo_pin_release_all(zfifo_device_data* this,
+                                  struct file *file){
+}
+
+#endif // ZFIFO_PIN_CACHE
+
+// ----------------------------------------------------------------------
+// Channel queue: transfers are appended to the descriptor area while the
+// channel runs; the channel halts and rewinds when everything completed,
+// or in ring mode keeps running and wraps around the descriptor area.
+
+typedef struct {
+  struct list_head   list;
+  struct file       *owner;     // NULL: nobody waits, freed on completion
+  unsigned long long cookie;
+  sg_mapping        *sg_map;    // user buffer, unmapped on completion
+  zfifo_reg_buf     *rb;        // or registered buffer
+  int                keep_map;  // sg_map is the caller's (debugfs bench)
+  struct kiocb      *iocb;      // async read/write: ki_complete()d
+  int                bounce;    // bounce slot + 1, or 0
+  char __user       *ubuf;      // bounced receive: copied here by the owner
+  unsigned long      frame;     // packet size, 0: the whole buffer
+  zfifo_frame       *frames;    // S2MM: received packets, nframes entries
+  unsigned           nframes;
+  unsigned           scan;      // S2MM: descriptors checked for RXEOF
+  unsigned long      actual;    // S2MM: bytes received
+  unsigned          *eof_desc;  // S2MM: out, descriptor the packet ended
+  int                chunk;     // ZFIFO_CHUNK_*: part of a larger packet
+  zfifo_io_ex       *ex;        // out: report, added up over chunks
+  ktime_t            t_queue;
+  s64                build_ns;  // writing the descriptor chain
+  unsigned long      len;
+  unsigned           first, last; // descriptor slots
+  unsigned           nslots;
+  unsigned           hole;      // slots of cancelled requests behind it
+  ktime_t            t_submit;
+  int                done;
+  long               result;
+} zfifo_req;
+
+#define ZFIFO_CHUNK_CONT 1 // continues a packet: no SOF
+#define ZFIFO_CHUNK_MORE 2 // the packet goes on: no EOF
+
+static zfifo_chan *zfifo_chan_of(zfifo_device_data* this,
+                                 enum dma_data_direction dir){
+  return (dir == DMA_TO_DEVICE) ? &this->mm2s : &this->s2mm;
+}
+
+// Account the pinning and mapping of a buffer once (ch->lock held)
+static void zfifo_perf_map(zfifo_chan *ch, sg_mapping *sg_map){
+  if (sg_map->accounted) return;
+  sg_map->accounted = 1;
+  ch->perf.pages   += sg_map->npages;
+  ch->perf.sg_ents += sg_map->nents;
+  ch->perf.descs   += sg_map->num_sg;
+  ch->perf.pin_ns  += sg_map->pin_ns;
+  ch->perf.map_ns  += sg_map->map_ns;
+}
+
+// Account a retired transfer (ch->lock held)
+static void zfifo_perf_done(zfifo_chan *ch, unsigned long bytes, long result,
+                            s64 dma_ns){
+  u64 us = (dma_ns > 0) ? div_u64(dma_ns, 1000) : 0;
+  int b = min_t(int, fls64(us), ZFIFO_HIST_BUCKETS - 1);
+
+  ch->perf.transfers++;
+  if (result < 0)
+    ch->perf.errors++;
+  else
+    ch->perf.bytes += bytes;
+  if (dma_ns > 0) ch->perf.dma_ns += dma_ns;
+  ch->perf.hist[b]++;
+}
+
+static void zfifo_perf_reset(zfifo_chan *ch){
+  mutex_lock(&ch->lock);
+  memset(&ch->perf, 0, sizeof(ch->perf));
+  ch->perf.irq_base = atomic_read(&ch->irq_events);
+  mutex_unlock(&ch->lock);
+}
+
+static void zfifo_chan_init(zfifo_chan *ch, volatile unsigned __iomem *regs,
+                            enum dma_data_direction dir){
+  ch->regs = regs;
+  ch->dir  = dir;
+  ch->ring = ring_mode;
+  atomic_set(&ch->irq_events, 0);
+  INIT_LIST_HEAD(&ch->active);
+  INIT_LIST_HEAD(&ch->done);
+  mutex_init(&ch->lock);
+}
+
+// ----------------------------------------------------------------------
+// Bounce pool: small transfers are copied through preallocated coherent
+// buffers, no pinning, mapping nor cache maintenance
+
+static void *zfifo_bounce_buf(zfifo_chan *ch, zfifo_req *req){
+  return ch->bounce + (size_t)(req->bounce - 1) * ch->bounce_size;
+}
+
+// Take a free slot, 0 if none (ch->lock held)
+static int zfifo_bounce_get(zfifo_chan *ch){
+  unsigned long slot;
+
+  if (ch->bounce == NULL) return 0;
+  slot = find_first_zero_bit(&ch->bounce_map, ch->bounce_slots);
+  if (slot >= ch->bounce_slots) return 0;
+  __set_bit(slot, &ch->bounce_map);
+  ch->bounced++;
+  return slot + 1;
+}
+
+static void zfifo_bounce_put(zfifo_chan *ch, zfifo_req *req){
+  if (req->bounce){
+    __clear_bit(req->bounce - 1, &ch->bounce_map);
+    req->bounce = 0;
+  }
+}
+
+// Copy a bounced receive to the user buffer, in the owner's context
+// (ch->lock held)
+static long zfifo_bounce_copyout(zfifo_chan *ch, zfifo_req *req,
+                                 long result){
+  if (req->bounce && ch->dir == DMA_FROM_DEVICE && result > 0 &&
+      copy_to_user(req->ubuf, zfifo_bounce_buf(ch, req), result))
+    return -EFAULT;
+  return result;
+}
+
+// Free a retired request (ch->lock held)
+static void zfifo_req_free(zfifo_chan *ch, zfifo_req *req){
+  list_del(&req->list);
+  zfifo_bounce_put(ch, req);
+  kfree(req);
+}
+
+// ----------------------------------------------------------------------
+// Completion eventfds: signalled whenever a transfer of the file completes
+
+typedef struct {
+  struct list_head    list;
+  struct file        *file;
+  struct eventfd_ctx *ctx;
+} zfifo_evfd;
+
+static void zfifo_evfd_signal(zfifo_device_data* this, struct file *file){
+  zfifo_evfd *ev;
+  unsigned long flags;
+
+  if (atomic_read(&this->nr_evfd) == 0) return;
+
+  spin_lock_irqsave(&this->evfd_lock, flags);
+  list_for_each_entry(ev, &this->evfds, list){
+    if (ev->file == file){
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,8,0)
+      eventfd_signal(ev->ctx);
+#else
+      eventfd_signal(ev->ctx, 1);
+#endif
+      break;
+    }
+  }
+  spin_unlock_irqrestore(&this->evfd_lock, flags);
+}
+
+// Set (fd >= 0) or clear (fd < 0) the completion eventfd of this file
+static int zfifo_evfd_set(zfifo_device_data* this, struct file *file, int fd){
+  struct eventfd_ctx *ctx = NULL;
+  zfifo_evfd *ev, *tmp, *nev = NULL;
+  unsigned long flags;
+
+  if (fd >= 0){
+    ctx = eventfd_ctx_fdget(fd);
+    if (IS_ERR(ctx)) return PTR_ERR(ctx);
+    if ((nev = kmalloc(sizeof(*nev), GFP_KERNEL)) == NULL){
+      eventfd_ctx_put(ctx);
+      return -ENOMEM;
+    }
+    nev->file = file;
+    nev->ctx  = ctx;
+  }
+
+  spin_lock_irqsave(&this->evfd_lock, flags);
+  list_for_each_entry_safe(ev, tmp, &this->evfds, list){
+    if (ev->file == file){
+      list_del(&ev->list);
+      atomic_dec(&this->nr_evfd);
+      spin_unlock_irqrestore(&this->evfd_lock, flags);
+      eventfd_ctx_put(ev->ctx);
+      kfree(ev);
+      spin_lock_irqsave(&this->evfd_lock, flags);
+      break;
+    }
+  }
+  if (nev != NULL){
+    list_add(&nev->list, &this->evfds);
+    atomic_inc(&this->nr_evfd);
+  }
+  spin_unlock_irqrestore(&this->evfd_lock, flags);
+  return 0;
+}
+
+// DMACR run value: IOC interrupts every irq_threshold completions, or
+// after irq_delay when fewer arrived
+static void zfifo_chan_set_dmacr(zfifo_device_data* this, zfifo_chan *ch){
+  unsigned dmacr = DMACR_RS;
+
+  if (ch->irq != 0){
+    dmacr |= DMACR_IOC_Irq | DMACR_Err_Irq |
+             DMACR_IRQThreshold(this->irq_threshold);
+    if (this->irq_delay != 0)
+      dmacr |= DMACR_Dly_Irq | DMACR_IRQDelay(this->irq_delay);
+  }
+
+  mutex_lock(&ch->lock);
+  ch->dmacr = dmacr;
+  if (ch->running) ch->regs[CH_DMACR] = dmacr;
+  mutex_unlock(&ch->lock);
+}
+
+static int zfifo_set_coalesce(zfifo_device_data* this,
+                              unsigned threshold, unsigned delay){
+  // without the delay timer the last few completions would never interrupt
+  if (threshold < 1 || threshold > 255 || delay > 255 ||
+      (threshold > 1 && delay == 0))
+    return -EINVAL;
+
+  this->irq_threshold = threshold;
+  this->irq_delay     = delay;
+  zfifo_chan_set_dmacr(this, &this->mm2s);
+  zfifo_chan_set_dmacr(this, &this->s2mm);
+  return 0;
+}
+
+// Reserve n descriptor slots (ch->lock held), -EAGAIN if the channel
+// has to drain first
+static int zfifo_chan_reserve(zfifo_chan *ch, unsigned n){
+  if (n > ch->ndesc) return -E2BIG;
+  if (ch->ring){
+    if (ch->used + n > ch->ndesc) return -EAGAIN;
+  } else {
+    if (ch->head + n > ch->ndesc) return -EAGAIN;
+  }
+  return ch->head;
+}
+
+// Hand descriptors [first, last] to the DMA (ch->lock held). In ring
+// mode the channel is started once and then only TAILDESC moves.
+static void zfifo_chan_kick(zfifo_chan *ch, unsigned first, unsigned last){
+  dma_addr_t head = ch->phys + 0x40 * first;
+  dma_addr_t tail = ch->phys + 0x40 * last;
+
+  if (!ch->running){
+    ch->regs[CH_CURDESC   ] = LOW32 (head);
+    ch->regs[CH_CURDESC_H ] = HIGH32(head);
+    ch->regs[CH_DMACR     ] = ch->dmacr;
+    ch->running = 1;
+  }
+  // the previous tail already points here, so this appends while running
+  ch->regs[CH_TAILDESC  ] = LOW32 (tail);
+  ch->regs[CH_TAILDESC_H] = HIGH32(tail);
+  ch->used += (last + ch->ndesc - first) % ch->ndesc + 1;
+  ch->head  = (last + 1) % ch->ndesc;
+}
+
+// Wait until (*reg & mask) == want, polling up to timeout_us. The
+// emulated registers are memory that the emulator thread updates: sleep
+// between reads there, since a spin starves the thread on a single CPU
+// or without preemption, and allow for its idle sleep (at least 100ms).
+static int zfifo_reg_wait(volatile unsigned __iomem *reg, unsigned mask,
+                          unsigned want, unsigned timeout_us){
+#ifdef ZFIFO_EMU
+  unsigned long end = jiffies + msecs_to_jiffies(max(timeout_us/1000, 100u));
+
+  while ((*reg & mask) != want){
+    if (time_after(jiffies, end)) return -ETIMEDOUT;
+    usleep_range(10, 50);
+  }
+  return 0;
+#else
+  unsigned t;
+
+  for (t=0; t<timeout_us && (*reg & mask) != want; t++)
+    udelay(1);
+  return ((*reg & mask) == want) ? 0 : -ETIMEDOUT;
+#endif
+}
+
+// Stop the channel; pending descriptors are flushed (ch->lock held)
+static void zfifo_chan_halt(zfifo_chan *ch){
+  ch->regs[CH_DMACR] = ch->dmacr & ~DMACR_RS;
+  if (zfifo_reg_wait(&ch->regs[CH_DMASR], DMASR_HALTED, DMASR_HALTED, 1000))
+    printk(KERN_ERR "zfifo: %s did not halt, DMASR=0x%x\n",
+           (ch->dir == DMA_TO_DEVICE) ? "MM2S" : "S2MM",
+           ch->regs[CH_DMASR]);
+  ch->running = 0;
+}
+
+static void zfifo_dmac_reset(zfifo_device_data* this){
+  this->dma_regs[MM2S_DMACR] = DMACR_RESET;
+#ifdef ZFIFO_EMU
+  if (zfifo_reg_wait(&this->dma_regs[MM2S_DMACR], DMACR_RESET, 0, 0))
+    printk(KERN_ERR "zfifo: emulated AXI DMA did not reset\n");
+#else
+  while (this->dma_regs[MM2S_DMACR] & DMACR_RESET);
+#endif
+
+  this->dma_regs[S2MM_DMACR] = DMACR_RESET;
+#ifdef ZFIFO_EMU
+  if (zfifo_reg_wait(&this->dma_regs[S2MM_DMACR], DMACR_RESET, 0, 0))
+    printk(KERN_ERR "zfifo: emulated AXI DMA did not reset\n");
+#else
+  while (this->dma_regs[S2MM_DMACR] & DMACR_RESET);
+#endif
+
+  //   printk("Done AXI DMA Reset\n");
+}
+
+// Restart a halted channel at the oldest queued transfer (ch->lock held)
+static void zfifo_chan_restart(zfifo_chan *ch, unsigned first, unsigned last){
+  dma_addr_t head = ch->phys + 0x40 * first;
+  dma_addr_t tail = ch->phys + 0x40 * last;
+
+  ch->regs[CH_CURDESC   ] = LOW32 (head);
+  ch->regs[CH_CURDESC_H ] = HIGH32(head);
+  ch->regs[CH_DMACR     ] = ch->dmacr;
+  ch->regs[CH_TAILDESC  ] = LOW32 (tail);
+  ch->regs[CH_TAILDESC_H] = HIGH32(tail);
+  ch->running = 1;
+}
+
+// S2MM: find the packets (RXEOF) in the status words of a completed
+// request. Returns # of packets.
+static long zfifo_req_frames(zfifo_chan *ch, zfifo_req *req){
+  unsigned long off = 0, start = 0, plen = 0;
+  unsigned d, n = 0;
+
+  for (d=0; d<req->nslots; d++){
+    volatile unsigned *desc = ch->desc + ((req->first + d) % ch->ndesc)*16;
+    unsigned sts = desc[7];
+
+    plen += sts     & DESC_LEN_MASK;
+    off  += desc[6] & DESC_LEN_MASK;
+    if (sts & DESC_STS_RXEOF){
+      if (n < req->nframes){
+        req->frames[n].offset = start;
+        req->frames[n].len    = plen;
+      }
+      n++;
+      start = off;
+      plen  = 0;
+    }
+  }
+  return n;
+}
+
+// ----------------------------------------------------------------------
+// Receive ring: kernel buffers kept posted on S2MM, mmap()ed by one file
+
+// Hand the slots user space returned (ctl->cons) back to the DMA
+// (s2mm.lock held)
+static void zfifo_rxring_refill(zfifo_device_data* this, zfifo_rx_ring *r){
+  zfifo_chan *ch = &this->s2mm;
+  unsigned cons = READ_ONCE(r->ctl->cons);
+  dma_addr_t tail;
+
+  if (r->prod - cons > r->nslots) cons = r->prod; // bogus index
+  if (cons + r->nslots == r->posted || r->error) return;
+
+  r->posted = cons + r->nslots;
+  tail = ch->phys + 0x40 * ((r->posted - 1) % r->nslots);
+  ch->regs[CH_TAILDESC  ] = LOW32 (tail);
+  ch->regs[CH_TAILDESC_H] = HIGH32(tail);
+}
+
+// Publish completed slots to user space (s2mm.lock held)
+static int zfifo_rxring_reap(zfifo_device_data* this, zfifo_rx_ring *r){
+  zfifo_chan *ch = &this->s2mm;
+  unsigned sr = ch->regs[CH_DMASR];
+  int n = 0;
+
+  if (sr & DMASR_IRQ_MASK)
+    ch->regs[CH_DMASR] = sr & DMASR_IRQ_MASK;
+
+  while (r->prod != r->posted){
+    unsigned slot = r->prod % r->nslots;
+    unsigned sts  = ch->desc[slot*16 +7];
+
+    if (!(sts & DESC_STS_CMPLT)) break;
+    r->ctl->len[slot] = (sts & DESC_LEN_MASK) |
+      ((sts & DESC_STS_RXEOF) ? 0 : ZFIFO_RXRING_MORE);
+    ch->desc[slot*16 +7] = 0; // fetched again after the next refill
+    r->prod++;
+    n++;
+  }
+  if (n != 0){
+    smp_wmb(); // lengths before the index
+    WRITE_ONCE(r->ctl->prod, r->prod);
+    ch->completed += n;
+  }
+
+  if ((sr & DMASR_ERR_MASK) && !r->error){
+    printk(KERN_ERR "zfifo: S2MM receive ring DMA error, DMASR=0x%x\n", sr);
+    r->error = 1;
+    this->dma_error = 1;
+  }
+  zfifo_rxring_refill(this, r);
+  return n;
+}
+
+// Allocate the ring with the device geometry and start S2MM on it
+static int zfifo_rxring_start(zfifo_device_data* this, struct file *file){
+  zfifo_chan *ch = &this->s2mm;
+  zfifo_rx_ring *r;
+  size_t ctl_size;
+  unsigned i;
+
+  if (this->rxring_slots == 0 || this->rxring_slots > ch->ndesc ||
+      this->rxring_slot_size == 0 || (this->rxring_slot_size & 0x3) ||
+      this->rxring_slot_size >= this->dmac_buf_len)
+    return -EINVAL;
+  if (!list_empty(&ch->active) || this->bypass != NULL)
+    return -EBUSY;
+
+  if ((r = kzalloc(sizeof(*r), GFP_KERNEL)) == NULL)
+    return -ENOMEM;
+  r->owner     = file;
+  r->nslots    = this->rxring_slots;
+  r->slot_size = this->rxring_slot_size;
+  ctl_size = PAGE_ALIGN(sizeof(zfifo_rxring) + sizeof(unsigned) * r->nslots);
+  r->size  = ctl_size + PAGE_ALIGN((size_t)r->nslots * r->slot_size);
+  r->ctl   = dma_alloc_coherent(this->dma_dev, r->size, &r->dma, GFP_KERNEL);
+  if (r->ctl == NULL){
+    kfree(r);
+    return -ENOMEM;
+  }
+  memset(r->ctl, 0, ctl_size);
+  r->ctl->nslots      = r->nslots;
+  r->ctl->slot_size   = r->slot_size;
+  r->ctl->data_offset = ctl_size;
+
+  // one descriptor per slot, closed into a ring of nslots
+  for (i=0; i<r->nslots; i++){
+    dma_addr_t next_desc = ch->phys + 0x40 * ((i+1) % r->nslots);
+    dma_addr_t buf = r->dma + ctl_size + (dma_addr_t)i * r->slot_size;
+
+    ch->desc[i*16 + 0] = LOW32(next_desc);
+    ch->desc[i*16 + 1] = HIGH32(next_desc);
+    ch->desc[i*16 + 2] = LOW32(buf);
+    ch->desc[i*16 + 3] = HIGH32(buf);
+    ch->desc[i*16 + 4] = 0;
+    ch->desc[i*16 + 5] = 0;
+    ch->desc[i*16 + 6] = r->slot_size & DESC_LEN_MASK;
+    ch->desc[i*16 + 7] = 0;
+  }
+
+  if (ch->running) zfifo_chan_halt(ch); // idle ring mode channel
+  ch->head = 0;
+  this->rxring = r;
+
+  zfifo_chan_restart(ch, 0, r->nslots - 1);
+  r->posted = r->nslots;
+  return 0;
+}
+
+// Stop S2MM and free the ring (s2mm.lock held)
+static void zfifo_rxring_stop(zfifo_device_data* this){
+  zfifo_rx_ring *r = this->rxring;
+
+  zfifo_chan_halt(&this->s2mm);
+  this->s2mm.head = 0;
+  this->rxring = NULL;
+  dma_free_coherent(this->dma_dev, r->size, r->ctl, r->dma);
+  kfree(r);
+}
+
+// ----------------------------------------------------------------------
+// Kernel bypass: user space posts entries to shared queues, a kernel
+// thread checks them against the buffer pool and writes the descriptors
+
+// Advance the completion index of queue qi past the completed
+// descriptors. Returns it.
+static unsigned zfifo_bypass_done(zfifo_chan *ch, zfifo_bypass *bp, int qi){
+  unsigned mask = bp->depth - 1;
+
+  while (bp->done[qi] != bp->sq_head[qi] &&
+         (ch->desc[(bp->done[qi] & mask)*16 +7] & DESC_STS_CMPLT))
+    bp->done[qi]++;
+  return bp->done[qi];
+}
+
+// Give the entries posted to queue qi to the DMA. Returns # of entries.
+static int zfifo_bypass_feed(zfifo_device_data* this, zfifo_bypass *bp,
+                             int qi){
+  zfifo_chan *ch = (qi == ZFIFO_BYPASS_TX) ? &this->mm2s : &this->s2mm;
+  zfifo_bypass_queue *q = &bp->ctl->q[qi];
+  zfifo_bypass_entry *ent = bp->ent[qi];
+  unsigned mask = bp->depth - 1;
+  unsigned head = bp->sq_head[qi];
+  unsigned tail = READ_ONCE(q->sq_tail);
+  unsigned cq   = READ_ONCE(q->cq_head);
+  unsigned done;
+  unsigned i;
+
+  if (tail == head || bp->error) return 0;
+
+  // sq_tail and cq_head are user writable: bound the doorbell by the
+  // descriptors the DMA is not using, by our own indexes
+  done = zfifo_bypass_done(ch, bp, qi);
+  if (tail - head > bp->depth - (head - done)){
+    printk(KERN_ERR "zfifo: bypass %s doorbell %u overruns the queue "
+           "(head %u, completed %u)\n",
+           (qi == ZFIFO_BYPASS_TX) ? "TX" : "RX", tail, head, done);
+    bp->error = 1;
+    bp->ctl->flags |= ZFIFO_BYPASS_ERROR;
+    return 0;
+  }
+  // cq_head is only a hint to keep completed entries until consumed,
+  // taken when it is not ahead of the completion index
+  if (done - cq <= bp->depth && cq + bp->depth - head < tail - head)
+    tail = cq + bp->depth;
+  if (tail == head) return 0;
+  smp_rmb(); // entries were written before the doorbell
+
+  for (i = head; i != tail; i++){
+    unsigned slot = i & mask;
+    // read once: user space may rewrite the entry under us
+    unsigned off   = READ_ONCE(ent[slot].offset);
+    unsigned len   = READ_ONCE(ent[slot].len);
+    unsigned flags = READ_ONCE(ent[slot].flags);
+    dma_addr_t next_desc = ch->phys + 0x40 * ((slot+1) & mask);
+    dma_addr_t buf = bp->pool_dma + off;
+
+    if (len == 0 || ((off | len) & 0x3) || len >= this->dmac_buf_len ||
+        len > bp->pool_size || off > bp->pool_size - len){
+      printk(KERN_ERR "zfifo: bypass %s entry %u is out of the pool\n",
+             (qi == ZFIFO_BYPASS_TX) ? "TX" : "RX", i);
+      bp->error = 1;
+      bp->ctl->flags |= ZFIFO_BYPASS_ERROR;
+      break;
+    }
+
+    ch->desc[slot*16 + 0] = LOW32(next_desc);
+    ch->desc[slot*16 + 1] = HIGH32(next_desc);
+    ch->desc[slot*16 + 2] = LOW32(buf);
+    ch->desc[slot*16 + 3] = HIGH32(buf);
+    ch->desc[slot*16 + 4] = 0;
+    ch->desc[slot*16 + 5] = 0;
+    ch->desc[slot*16 + 6] = (len & DESC_LEN_MASK) |
+      ((qi == ZFIFO_BYPASS_TX) ? (flags & (DESC_CTRL_SOF | DESC_CTRL_EOF)) : 0);
+    ch->desc[slot*16 + 7] = 0;
+  }
+  if (i == head) return 0;
+
+  wmb(); // descriptors before TAILDESC and sq_head
+  if (!ch->running){
+    zfifo_chan_restart(ch, head & mask, (i-1) & mask);
+  } else {
+    dma_addr_t taildesc = ch->phys + 0x40 * ((i-1) & mask);
+    ch->regs[CH_TAILDESC  ] = LOW32 (taildesc);
+    ch->regs[CH_TAILDESC_H] = HIGH32(taildesc);
+  }
+  bp->sq_head[qi] = i;
+  WRITE_ONCE(q->sq_head, i);
+  return i - head;
+}
+
+static int zfifo_bypass_pending(zfifo_bypass *bp){
+  if (bp->error) return 0; // nothing more is fed
+  return READ_ONCE(bp->ctl->q[0].sq_tail) != bp->sq_head[0] ||
+         READ_ONCE(bp->ctl->q[1].sq_tail) != bp->sq_head[1];
+}
+
+// Poll the doorbells, sleep after bypass_idle_us without work until
+// IOCTL_BYPASS_WAKEUP
+static int zfifo_bypass_thread(void *data){
+  zfifo_bypass *bp = data;
+  zfifo_device_data* this = bp->dev;
+  unsigned long idle = jiffies + usecs_to_jiffies(bypass_idle_us);
+
+  while (!kthread_should_stop()){
+    unsigned sr;
+
+    cond_resched();
+    if (zfifo_bypass_feed(this, bp, ZFIFO_BYPASS_TX) +
+        zfifo_bypass_feed(this, bp, ZFIFO_BYPASS_RX) != 0){
+      idle = jiffies + usecs_to_jiffies(bypass_idle_us);
+      continue;
+    }
+
+    sr = this->mm2s.regs[CH_DMASR] | this->s2mm.regs[CH_DMASR];
+    if ((sr & DMASR_ERR_MASK) && !bp->error){
+      printk(KERN_ERR "zfifo: bypass DMA error, DMASR=0x%x\n", sr);
+      bp->error = 1;
+      this->dma_error = 1;
+      bp->ctl->flags |= ZFIFO_BYPASS_ERROR;
+    }
+    if (time_before(jiffies, idle)) continue;
+
+    set_current_state(TASK_INTERRUPTIBLE);
+    bp->ctl->flags |= ZFIFO_BYPASS_NEED_WAKEUP;
+    smp_mb(); // flag before the doorbells, pairs with zf_bypass_doorbell()
+    if (!zfifo_bypass_pending(bp) && !kthread_should_stop())
+      schedule();
+    __set_current_state(TASK_RUNNING);
+    bp->ctl->flags &= ~ZFIFO_BYPASS_NEED_WAKEUP;
+    idle = jiffies + usecs_to_jiffies(bypass_idle_us);
+  }
+  return 0;
+}
+
+// IOCTL_BYPASS_SETUP: dedicate both channels to the bypass queues of file
+static int zfifo_bypass_start(zfifo_device_data* this, struct file *file,
+                              zfifo_bypass_setup *su){
+  zfifo_bypass *bp;
+  size_t ent_size;
+  int rc = 0;
+
+  if (!bypass_enable) return -EPERM;
+  if (!is_power_of_2(su->depth) || su->depth > this->mm2s.ndesc ||
+      su->pool_size == 0 || su->pool_size > bypass_pool_max)
+    return -EINVAL;
+
+  if ((bp = kzalloc(sizeof(*bp), GFP_KERNEL)) == NULL)
+    return -ENOMEM;
+  bp->dev       = this;
+  bp->owner     = file;
+  bp->depth     = su->depth;
+  bp->pool_size = PAGE_ALIGN(su->pool_size);
+  ent_size      = sizeof(zfifo_bypass_entry) * bp->depth;
+  bp->ctl_size  = PAGE_ALIGN(ALIGN(sizeof(zfifo_bypass_ctl), 64) + 2*ent_size);
+
+  bp->ctl  = vmalloc_user(bp->ctl_size);
+  bp->pool = dma_alloc_coherent(this->dma_dev, bp->pool_size, &bp->pool_dma,
+                                GFP_KERNEL);
+  if (bp->ctl == NULL || bp->pool == NULL){
+    rc = -ENOMEM;
+    goto err;
+  }
+  bp->ctl->depth          = bp->depth;
+  bp->ctl->pool_size      = bp->pool_size;
+  bp->ctl->desc_offset[0] = (void*)this->mm2s.desc - this->tx_desc_base;
+  bp->ctl->desc_offset[1] = (void*)this->s2mm.desc - this->rx_desc_base;
+  bp->ctl->q[0].entries   = ALIGN(sizeof(zfifo_bypass_ctl), 64);
+  bp->ctl->q[1].entries   = bp->ctl->q[0].entries + ent_size;
+  bp->ent[0] = (void*)bp->ctl + bp->ctl->q[0].entries;
+  bp->ent[1] = (void*)bp->ctl + bp->ctl->q[1].entries;
+
+  mutex_lock(&this->mm2s.lock);
+  mutex_lock(&this->s2mm.lock);
+  if (this->bypass != NULL || this->rxring != NULL ||
+      !list_empty(&this->mm2s.active) || !list_empty(&this->s2mm.active)){
+    rc = -EBUSY;
+  } else {
+    if (this->mm2s.running) zfifo_chan_halt(&this->mm2s);
+    if (this->s2mm.running) zfifo_chan_halt(&this->s2mm);
+    this->mm2s.head = this->s2mm.head = 0;
+    bp->thread = kthread_run(zfifo_bypass_thread, bp, "zfifo%d-bypass",
+                             MINOR(this->device_number));
+    if (IS_ERR(bp->thread))
+      rc = PTR_ERR(bp->thread);
+    else
+      this->bypass = bp;
+  }
+  mutex_unlock(&this->s2mm.lock);
+  mutex_unlock(&this->mm2s.lock);
+  if (rc == 0) return 0;
+
+ err:
+  if (bp->pool != NULL)
+    dma_free_coherent(this->dma_dev, bp->pool_size, bp->pool, bp->pool_dma);
+  vfree(bp->ctl);
+  kfree(bp);
+  return rc;
+}
+
+static void zfifo_bypass_stop(zfifo_device_data* this){
+  zfifo_bypass *bp = this->bypass;
+
+  kthread_stop(bp->thread);
+
+  mutex_lock(&this->mm2s.lock);
+  mutex_lock(&this->s2mm.lock);
+  zfifo_chan_halt(&this->mm2s);
+  zfifo_chan_halt(&this->s2mm);
+  this->mm2s.head = this->s2mm.head = 0;
+  this->bypass = NULL;
+  mutex_unlock(&this->s2mm.lock);
+  mutex_unlock(&this->mm2s.lock);
+
+  dma_free_coherent(this->dma_dev, bp->pool_size, bp->pool, bp->pool_dma);
+  vfree(bp->ctl);
+  kfree(bp);
+}
+
+// mmap() of the bypass regions (ZFIFO_MMAP_BYPASS_*)
+static int zfifo_bypass_mmap(zfifo_device_data* this, zfifo_bypass *bp,
+                             struct vm_area_struct *vma, unsigned long region){
+  unsigned long size = vma->vm_end - vma->vm_start;
+  int tx = (region == ZFIFO_MMAP_BYPASS_TXDESC);
+  zfifo_chan *ch = tx ? &this->mm2s : &this->s2mm;
+  void *desc_base = tx ? this->tx_desc_base : this->rx_desc_base;
+
+  vma->vm_pgoff = 0;
+  switch (region){
+  case ZFIFO_MMAP_BYPASS_CTL:
+    return remap_vmalloc_range(vma, bp->ctl, 0);
+
+  case ZFIFO_MMAP_BYPASS_TXDESC:
+  case ZFIFO_MMAP_BYPASS_RXDESC:
+    // status polling only, the descriptors are written by the driver
+    if (vma->vm_flags & VM_WRITE) return -EPERM;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,3,0)
+    vm_flags_clear(vma, VM_MAYWRITE);
+#else
+    vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+    if (size > PAGE_ALIGN(((void*)ch->desc - desc_base) + 0x40 * bp->depth))
+      return -EINVAL;
+    return dma_mmap_coherent(this->dma_dev, vma, desc_base,
+                             tx ? this->tx_phys_base : this->rx_phys_base,
+                             size);
+
+  case ZFIFO_MMAP_BYPASS_POOL:
+    if (size > bp->pool_size) return -EINVAL;
+    return dma_mmap_coherent(this->dma_dev, vma, bp->pool, bp->pool_dma,
+                             size);
+  }
+  return -EINVAL;
+}
+
+// S2MM: the packet (TLAST) ends the request at the first RXEOF
+// descriptor, which may come before the last one. Returns its index in
+// the request, or -1 while the packet is still coming in.
+static int zfifo_req_eop(zfifo_chan *ch, zfifo_req *req){
+  for (; req->scan < req->nslots; req->scan++){
+    unsigned sts = ch->desc[((req->first + req->scan) % ch->ndesc)*16 +7];
+
+    if (!(sts & DESC_STS_CMPLT)) return -1;
+    req->actual += sts & DESC_LEN_MASK;
+    if (sts & (DESC_STS_RXEOF | DESC_STS_ERR)) return req->scan;
+  }
+  return req->nslots - 1; // filled up without TLAST
+}
+
+// Bytes that landed in the descriptors after a short packet ended at
+// eop: the start of the next packet, lost when the chain is flushed.
+// Only completed descriptors are known, the one in progress is not.
+static unsigned long zfifo_req_overrun(zfifo_chan *ch, zfifo_req *req,
+                                       int eop){
+  unsigned long n = 0;
+  unsigned d;
+
+  for (d=eop+1; d<req->nslots; d++){
+    unsigned sts = ch->desc[((req->first + d) % ch->ndesc)*16 +7];
+    if (sts & DESC_STS_CMPLT) n += sts & DESC_LEN_MASK;
+  }
+  return n;
+}
+
+// Bytes the DMA moved for a request, from the descriptor status words
+static unsigned long zfifo_req_bytes(zfifo_chan *ch, zfifo_req *req){
+  unsigned long n = 0;
+  unsigned d;
+
+  if (ch->dir == DMA_FROM_DEVICE && req->frames == NULL)
+    return req->actual;
+  for (d=0; d<req->nslots; d++){
+    unsigned sts = ch->desc[((req->first + d) % ch->ndesc)*16 +7];
+    if (sts & DESC_STS_CMPLT) n += sts & DESC_LEN_MASK;
+  }
+  return n;
+}
+
+// Add a retired request to its report (IOCTL_SEND_EX/RECV_EX)
+static void zfifo_req_report(zfifo_chan *ch, zfifo_req *req, ktime_t t_done){
+  zfifo_io_ex *ex = req->ex;
+  s64 t_irq = atomic64_read(&ch->t_irq);
+
+  if (t_irq < ktime_to_ns(req->t_submit))
+    t_irq = ktime_to_ns(t_done); // found by polling
+  ex->actual += zfifo_req_bytes(ch, req);
+  ex->ndesc  += req->nslots;
+  ex->dmasr  |= ch->last_sr & DMASR_ERR_MASK;
+  if (ex->t_submit == 0) ex->t_submit = ktime_to_ns(req->t_queue);
+  if (ex->t_start  == 0) ex->t_start  = ktime_to_ns(req->t_submit);
+  ex->t_irq = t_irq;
+}
+
+static void zfifo_req_complete(zfifo_device_data* this, zfifo_chan *ch,
+                               zfifo_req *req, long result){
+  unsigned long synclen; // what the CPU reads
+  ktime_t t_done = ktime_get();
+  s64 dt = ktime_to_ns(ktime_sub(t_done, req->t_submit));
+
+  if (result == 0 && req->frames != NULL)
+    result = zfifo_req_frames(ch, req); // # of packets
+  else if (result == 0 && ch->dir == DMA_FROM_DEVICE)
+    result = req->actual;               // bytes received
+  synclen = (ch->dir == DMA_FROM_DEVICE && req->frames == NULL) ?
+    req->actual : req->len;
+  if (req->ex != NULL)
+    zfifo_req_report(ch, req, t_done);
+
+  if (req->rb){
+    if (ch->dir == DMA_FROM_DEVICE)
+      sync_sg_buf(this, req->rb->sg_map, synclen, 0);
+    zfifo_reg_buf_put(this, req->rb);
+    req->rb = NULL;
+  } else if (req->sg_map){
+    if (!req->keep_map)
+      free_sg_buf_deferred(this, req->sg_map, synclen);
+    req->sg_map = NULL;
+  } else if (ch->dir == DMA_TO_DEVICE){
+    zfifo_bounce_put(ch, req); // receives keep it until copied out
+  }
+  ch->perf.unpin_ns += ktime_to_ns(ktime_sub(ktime_get(), t_done));
+
+  ch->used  -= req->nslots + req->hole;
+  ch->completed++;
+  zfifo_perf_done(ch, synclen, result, dt);
+  trace_zfifo_complete(ZFIFO_TRACE_MINOR(this), ZFIFO_TRACE_DIR(ch->dir),
+                       req->len, req->nslots, result);
+  if (result >= 0 && dt > 0){
+    unsigned long sample = div64_u64((u64)req->len * 1000, dt);
+    ch->bw = (ch->bw == 0) ? sample : (ch->bw * 7 + sample) / 8;
+  }
+  req->done   = 1;
+  req->result = result;
+  if (req->iocb){
+    long ret = (result || ch->dir == DMA_FROM_DEVICE) ? result : req->len;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,16,0)
+    req->iocb->ki_complete(req->iocb, ret);
+#else
+    req->iocb->ki_complete(req->iocb, ret, 0);
+#endif
+    atomic_dec(&this->nr_async);
+  }
+  zfifo_evfd_signal(this, req->owner);
+  if (req->owner == NULL){
+    zfifo_req_free(ch, req);
+  } else {
+    list_move_tail(&req->list, &ch->done);
+  }
+}
+
+// Retire completed transfers (ch->lock held), returns # retired
+static int zfifo_chan_reap(zfifo_device_data* this, zfifo_chan *ch){
+  zfifo_req *req, *tmp;
+  unsigned sr;
+  int n = 0, halted = 0;
+
+  if (ch == &this->s2mm && this->rxring != NULL)
+    return zfifo_rxring_reap(this, this->rxring);
+  // a halted channel may still hold completed ones (zfifo_req_cancel())
+  if ((!ch->running && list_empty(&ch->active)) || this->bypass != NULL)
+    return 0;
+
+  sr = ch->regs[CH_DMASR];
+  if (sr & DMASR_IRQ_MASK)
+    ch->regs[CH_DMASR] = sr & DMASR_IRQ_MASK;
+  ch->last_sr = sr;
+
+  list_for_each_entry_safe(req, tmp, &ch->active, list){
+    unsigned sts = ch->desc[req->last*16 +7];
+
+    if (ch->dir == DMA_FROM_DEVICE && req->frames == NULL){
+      int eop = zfifo_req_eop(ch, req);
+
+      sts = (eop < 0) ? 0 :
+        ch->desc[((req->first + eop) % ch->ndesc)*16 +7];
+      if (eop >= 0 && eop != req->nslots - 1){
+        // short packet: flush the rest of the chain before the buffer
+        // goes back to the user, continue at the next request
+        unsigned long lost;
+
+        zfifo_chan_halt(ch);
+        halted = 1;
+        if ((lost = zfifo_req_overrun(ch, req, eop)) != 0){
+          ch->perf.dropped += lost;
+          dev_warn_ratelimited(this->sys_dev, "S2MM: %lu bytes of the next "
+                               "packet dropped after a short one\n", lost);
+        }
+      }
+      if (eop >= 0 && req->eof_desc != NULL &&
+          (!(req->chunk & ZFIFO_CHUNK_MORE) || (sts & DESC_STS_RXEOF)))
+        *req->eof_desc = eop; // chunks report TLAST only
+    }
+
+    if (sts & DESC_STS_CMPLT){
+      zfifo_req_complete(this, ch, req, (sts & DESC_STS_ERR) ? -EIO : 0);
+    } else if (sr & DMASR_ERR_MASK){
+      // the channel halted on error: nothing behind it will complete
+      zfifo_req_complete(this, ch, req, -EIO);
+    } else {
+      break;
+    }
+    n++;
+  }
+
+  if (sr & DMASR_ERR_MASK){
+    printk(KERN_ERR "zfifo: %s DMA error, DMASR=0x%x\n",
+           (ch->dir == DMA_TO_DEVICE) ? "MM2S" : "S2MM", sr);
+    // the core keeps the error and stays halted until a reset
+    ch->regs[CH_DMACR] = 0;
+    ch->running = 0;
+    this->dma_error = 1;
+  } else if (halted && !list_empty(&ch->active)){
+    zfifo_chan_restart(ch,
+                       list_first_entry(&ch->active, zfifo_req, list)->first,
+                       list_last_entry (&ch->active, zfifo_req, list)->last);
+  } else if (list_empty(&ch->active) && !ch->ring){
+    ch->regs[CH_DMACR] = 0; // stop
+    ch->running = 0;
+    ch->head    = 0;
+  }
+  return n;
+}
+
+// Soft reset of the DMA after an error (or IOCTL_RESET when force): the
+// core keeps its error bits and stays halted until then, and the reset
+// stops both channels, so whatever is still queued on either fails and
+// the rings start over. -EBUSY while the bypass queues own the channels.
+static int zfifo_dmac_recover(zfifo_device_data* this, int force){
+  zfifo_chan *chs[2] = { &this->mm2s, &this->s2mm };
+  zfifo_req *req, *tmp;
+  int c, rc = 0;
+
+  mutex_lock(&this->mm2s.lock);
+  mutex_lock(&this->s2mm.lock);
+  if (this->bypass != NULL){
+    rc = -EBUSY;
+    goto out;
+  }
+  if (!force && !this->dma_error) goto out;
+
+  for (c=0; c<2; c++){
+    zfifo_chan *ch = chs[c];
+
+    zfifo_chan_reap(this, ch); // those done keep their result
+    if (ch->running) zfifo_chan_halt(ch);
+    list_for_each_entry_safe(req, tmp, &ch->active, list)
+      zfifo_req_complete(this, ch, req, force ? -ECANCELED : -EIO);
+  }
+  zfifo_dmac_reset(this);
+  for (c=0; c<2; c++){
+    chs[c]->running = 0;
+    chs[c]->head    = 0;
+    chs[c]->used    = 0;
+  }
+  if (this->rxring != NULL)
+    this->rxring->error = 1; // its slots are no longer posted
+  this->dma_error = 0;
+  dev_info(this->sys_dev, "AXI DMA reset\n");
+ out:
+  mutex_unlock(&this->s2mm.lock);
+  mutex_unlock(&this->mm2s.lock);
+  return rc;
+}
+
+// Completion wait policies
+#define ZFIFO_WAIT_POLL   0
+#define ZFIFO_WAIT_SLEEP  1
+#define ZFIFO_WAIT_HYBRID 2
+
+static const char * const zfifo_wait_policy_name[] = {
+  "poll", "sleep", "hybrid"
+};
+
+typedef struct {
+  ktime_t  poll_until;  // busy-poll until then, sleep afterwards
+  unsigned sleep_us;    // sleep slice without IRQ
+} zfifo_wait_ctx;
+
+// Plan a wait for len bytes: hybrid polls only when the transfer is
+// expected to finish within poll_us at the measured bandwidth
+static void zfifo_wait_begin(zfifo_device_data* this, zfifo_chan *ch,
+                             unsigned long len, zfifo_wait_ctx *wc){
+  unsigned long est_us = (ch->bw != 0) ? len / ch->bw : 0;
+
+  wc->sleep_us = clamp_val(est_us / 4, 10, 1000);
+
+  switch (this->wait_policy){
+  case ZFIFO_WAIT_POLL:
+    wc->poll_until = KTIME_MAX;
+    break;
+  case ZFIFO_WAIT_SLEEP:
+    wc->poll_until = 0;
+    break;
+  default:
+    wc->poll_until = (est_us <= this->poll_us) ?
+      ktime_add_us(ktime_get(), this->poll_us) : 0;
+    break;
+  }
+}
+
+// Wait until the channel may have progressed: spin within the poll
+// budget, then sleep for an interrupt (or a while without IRQ)
+static int zfifo_chan_wait_event(zfifo_device_data* this, zfifo_chan *ch,
+                                 zfifo_wait_ctx *wc, int events,
+                                 int interruptible){
+  int rc;
+
+  if (fatal_signal_pending(current) ||
+      (interruptible && signal_pending(current)))
+    return -EINTR;
+
+  if (wc->poll_until == KTIME_MAX || ktime_before(ktime_get(), wc->poll_until)){
+    cpu_relax();
+    return 0;
+  }
+
+  ch->sleeps++;
+  if (ch->irq == 0){
+    usleep_range(wc->sleep_us, wc->sleep_us * 2);
+    rc = 0;
+  } else if (interruptible){
+    rc = wait_event_interruptible(this->waitq,
+                                  atomic_read(&ch->irq_events) != events);
+  } else {
+    rc = wait_event_killable(this->waitq,
+                             atomic_read(&ch->irq_events) != events);
+  }
+  trace_zfifo_wakeup(ZFIFO_TRACE_MINOR(this), ZFIFO_TRACE_DIR(ch->dir), 0, 0);
+  return rc;
+}
+
+// Either channel in pending (bit 0 MM2S, bit 1 S2MM) got an interrupt
+static bool zfifo_events_moved(zfifo_device_data* this, int pending,
+                               const int *events){
+  return ((pending & 1) && atomic_read(&this->mm2s.irq_events) != events[0]) ||
+         ((pending & 2) && atomic_read(&this->s2mm.irq_events) != events[1]);
+}
+
+// zfifo_chan_wait_event() over both channels at once, so that a wait for
+// transfers on MM2S and S2MM wakes up on whichever completes first
+static int zfifo_dev_wait_event(zfifo_device_data* this, zfifo_wait_ctx *wc,
+                                int pending, const int *events){
+  int rc = 0;
+
+  if (signal_pending(current))
+    return -EINTR;
+
+  if (wc->poll_until == KTIME_MAX || ktime_before(ktime_get(), wc->poll_until)){
+    cpu_relax();
+    return 0;
+  }
+
+  if (pending & 1) this->mm2s.sleeps++;
+  if (pending & 2) this->s2mm.sleeps++;
+  if (((pending & 1) && this->mm2s.irq == 0) ||
+      ((pending & 2) && this->s2mm.irq == 0)){
+    usleep_range(wc->sleep_us, wc->sleep_us * 2);
+  } else {
+    rc = wait_event_interruptible(this->waitq,
+                                  zfifo_events_moved(this, pending, events));
+  }
+  trace_zfifo_wakeup(ZFIFO_TRACE_MINOR(this), (pending & 2) ? 1 : 0, 0, 0);
+  return rc;
+}
+
+// Release the buffer of a request that never made it to the ring
+static void zfifo_req_discard(zfifo_device_data* this, zfifo_chan *ch,
+                              zfifo_req *req){
+  if (req->rb){
+    zfifo_reg_buf_put(this, req->rb);
+  } else if (req->sg_map){
+    if (!req->keep_map)
+      free_sg_buf(req->sg_map);
+  } else {
+    mutex_lock(&ch->lock);
+    zfifo_bounce_put(ch, req);
+    mutex_unlock(&ch->lock);
+  }
+  kfree(req);
+}
+
+// Put a prepared request (req->sg_map or req->rb, req->len) on the ring,
+// waiting for free descriptors unless nowait. The request is discarded
+// on failure.
+static int zfifo_queue(zfifo_device_data* this, zfifo_req *req,
+                       enum dma_data_direction dir, int nowait){
+  zfifo_chan *ch = zfifo_chan_of(this, dir);
+  zfifo_wait_ctx wc;
+  ktime_t t_build;
+  unsigned n, d;
+  int first;
+
+  req->t_queue = ktime_get();
+  if (READ_ONCE(this->dma_error))
+    zfifo_dmac_recover(this, 0);
+
+  if (req->sg_map){
+    n = req->sg_map->max_desc;
+    if (req->frame != 0) // one more at each frame boundary at most
+      n += DIV_ROUND_UP(req->len, req->frame);
+  } else if (req->bounce){
+    n = 1;
+  } else {
+    n = req->rb->sg_map->num_sg;
+    sync_sg_buf(this, req->rb->sg_map, req->len, 1);
+  }
+  trace_zfifo_submit(ZFIFO_TRACE_MINOR(this), ZFIFO_TRACE_DIR(dir),
+                     req->len, n);
+
+  zfifo_wait_begin(this, ch, 0, &wc);
+  for(;;){
+    int events = atomic_read(&ch->irq_events);
+    int rc;
+
+    if (!nowait){
+      mutex_lock(&ch->lock);
+    } else if (!mutex_trylock(&ch->lock)){
+      zfifo_req_discard(this, ch, req);
+      return -EAGAIN;
+    }
+    if ((ch == &this->s2mm && this->rxring != NULL) || this->bypass != NULL){
+      mutex_unlock(&ch->lock);
+      zfifo_req_discard(this, ch, req);
+      return -EBUSY;
+    }
+    zfifo_chan_reap(this, ch);
+    first = zfifo_chan_reserve(ch, n);
+    if (first >= 0) break;
+    mutex_unlock(&ch->lock);
+
+    rc = (first == -EAGAIN && !nowait) ?
+      // a continuation chunk waits out ordinary signals: giving up in the
+      // middle of a packet leaves it open in the PL
+      zfifo_chan_wait_event(this, ch, &wc, events,
+                            !(req->chunk & ZFIFO_CHUNK_CONT)) : first;
+    if (rc){
+      zfifo_req_discard(this, ch, req);
+      return rc;
+    }
+  }
+
+  t_build = ktime_get();
+  if (req->sg_map){
+    d = build_sg_desc(this, req->sg_map, ch->desc, ch->phys,
+                      first, ch->ndesc, req->frame);
+  } else if (req->bounce){
+    // one descriptor for the whole bounce buffer
+    unsigned *dst = ch->desc + first*16;
+    dma_addr_t next_desc = ch->phys + 0x40 * ((first+1) % ch->ndesc);
+    dma_addr_t buf = ch->bounce_dma +
+                     (dma_addr_t)(req->bounce - 1) * ch->bounce_size;
+
+    dst[0] = LOW32(next_desc);
+    dst[1] = HIGH32(next_desc);
+    dst[2] = LOW32(buf);
+    dst[3] = HIGH32(buf);
+    dst[4] = 0;
+    dst[5] = 0;
+    dst[6] = (req->len & DESC_LEN_MASK) | DESC_CTRL_SOF | DESC_CTRL_EOF;
+    dst[7] = 0;
+    d = 1;
+  } else {
+    // copy the prebuilt chain up to len, the last one truncated
+    unsigned long acc = 0;
+    for (d=0; d<n; d++){
+      unsigned cur = (first + d) % ch->ndesc;
+      volatile unsigned *dst = ch->desc + cur*16;
+      unsigned *src = req->rb->desc + d*16;
+      dma_addr_t next_desc = ch->phys + 0x40 * ((cur+1) % ch->ndesc);
+      unsigned dlen = src[6] & DESC_LEN_MASK;
+
+      dst[0] = LOW32(next_desc);
+      dst[1] = HIGH32(next_desc);
+      dst[2] = src[2];
+      dst[3] = src[3];
+      dst[4] = 0;
+      dst[5] = 0;
+      dst[6] = src[6];
+      dst[7] = 0;
+      if (acc + dlen >= req->len){
+        dst[6] = (src[6] & DESC_CTRL_SOF) | DESC_CTRL_EOF |
+                 ((req->len - acc) & DESC_LEN_MASK);
+        d++;
+        break;
+      }
+      acc += dlen;
+    }
+  }
+
+  req->build_ns = ktime_to_ns(ktime_sub(ktime_get(), t_build));
+  ch->perf.build_ns += req->build_ns;
+  trace_zfifo_desc(ZFIFO_TRACE_MINOR(this), ZFIFO_TRACE_DIR(dir), req->len, d,
+                   (req->sg_map && req->sg_map->nents > d) ?
+                   req->sg_map->nents - d : 0);
+  if (req->sg_map || req->rb)
+    zfifo_perf_map(ch, req->sg_map ? req->sg_map : req->rb->sg_map);
+
+  if (req->chunk & ZFIFO_CHUNK_CONT)
+    ch->desc[first*16 +6] &= ~DESC_CTRL_SOF;
+  if (req->chunk & ZFIFO_CHUNK_MORE)
+    ch->desc[((first + d - 1) % ch->ndesc)*16 +6] &= ~DESC_CTRL_EOF;
+
+  req->first  = first;
+  req->last   = (first + d - 1) % ch->ndesc;
+  req->nslots = d;
+  req->t_submit = ktime_get();
+  req->cookie = (ch->next_cookie++ << 1) | (dir == DMA_FROM_DEVICE);
+  list_add_tail(&req->list, &ch->active);
+  zfifo_chan_kick(ch, req->first, req->last);
+  trace_zfifo_kick(ZFIFO_TRACE_MINOR(this), ZFIFO_TRACE_DIR(dir), req->len, d);
+
+  mutex_unlock(&ch->lock);
+  return 0;
+}
+
+// Request through a bounce buffer for a small transfer, NULL if it
+// should take the zero-copy path
+static zfifo_req *zfifo_req_new_bounce(zfifo_device_data* this,
+                                       struct file *file,
+                                       char __user *bufp, unsigned long len,
+                                       enum dma_data_direction dir){
+  zfifo_chan *ch = zfifo_chan_of(this, dir);
+  zfifo_req *req;
+  int slot;
+
+  if (len > this->bounce_threshold) return NULL;
+
+  mutex_lock(&ch->lock);
+  slot = zfifo_bounce_get(ch);
+  mutex_unlock(&ch->lock);
+  if (slot == 0) return NULL;
+
+  if ((req = kzalloc(sizeof(*req), GFP_KERNEL)) == NULL){
+    mutex_lock(&ch->lock);
+    __clear_bit(slot - 1, &ch->bounce_map);
+    mutex_unlock(&ch->lock);
+    return ERR_PTR(-ENOMEM);
+  }
+  req->owner  = file;
+  req->len    = len;
+  req->bounce = slot;
+  req->ubuf   = bufp;
+
+  if (dir == DMA_TO_DEVICE &&
+      copy_from_user(zfifo_bounce_buf(ch, req), bufp, len)){
+    zfifo_req_discard(this, ch, req);
+    return ERR_PTR(-EFAULT);
+  }
+  return req;
+}
+
+// Request for a pinned user buffer, not queued yet. A plain transfer
+// (one packet, no frames) may go through a bounce buffer or the pin cache.
+static zfifo_req *zfifo_req_new_user(zfifo_device_data* this,
+                                     struct file *file,
+                                     char __user *bufp, unsigned long len,
+                                     enum dma_data_direction dir,
+                                     int plain){
+  zfifo_req *req;
+  zfifo_reg_buf *rb = NULL;
+
+  if (plain &&
+      (req = zfifo_req_new_bounce(this, file, bufp, len, dir)) != NULL)
+    return req;
+
+  if (plain && pin_cache_pages != 0 && current->mm != NULL){
+    rb = zfifo_pin_get(this, file, bufp, len, dir);
+    if (rb == NULL)
+      rb = zfifo_pin_add(this, file, bufp, len, dir);
+    if (IS_ERR(rb)) return ERR_CAST(rb);
+  }
+
+  if ((req = kzalloc(sizeof(*req), GFP_KERNEL)) == NULL){
+    if (rb != NULL) zfifo_reg_buf_put(this, rb);
+    return ERR_PTR(-ENOMEM);
+  }
+  req->owner  = file;
+  req->len    = len;
+  if (rb != NULL){
+    req->rb = rb;
+    return req;
+  }
+  req->sg_map = alloc_sg_buf(this, bufp, len, dir);
+  if (req->sg_map == NULL){
+    kfree(req);
+    return ERR_PTR(-ENOMEM);
+  }
+  return req;
+}
+
+// Queue one transfer from a user buffer or a registered buffer
+static zfifo_req *zfifo_submit(zfifo_device_data* this, struct file *file,
+                               enum dma_data_direction dir,
+                               char __user *bufp, unsigned long len,
+                               int handle){
+  zfifo_req *req;
+  int rc;
+
+  if (bufp != NULL){
+    req = zfifo_req_new_user(this, file, bufp, len, dir, 1);
+    if (IS_ERR(req)) return req;
+  } else {
+    if ((req = kzalloc(sizeof(*req), GFP_KERNEL)) == NULL)
+      return ERR_PTR(-ENOMEM);
+    req->owner = file;
+    req->rb = zfifo_reg_buf_get(this, file, handle, dir);
+    if (IS_ERR(req->rb)){
+      long err = PTR_ERR(req->rb);
+      kfree(req);
+      return ERR_PTR(err);
+    }
+    req->len = (len == 0 || len > req->rb->len) ? req->rb->len : len;
+  }
+
+  rc = zfifo_queue(this, req, dir, 0);
+  return rc ? ERR_PTR(rc) : req;
+}
+
+// Wait for one request returned by zfifo_submit() and free it
+static long zfifo_req_wait(zfifo_device_data* this, zfifo_req *req,
+                           enum dma_data_direction dir){
+  zfifo_chan *ch = zfifo_chan_of(this, dir);
+  zfifo_wait_ctx wc;
+  ktime_t t_wait = ktime_get();
+  long result;
+
+  zfifo_wait_begin(this, ch, req->len, &wc);
+  for(;;){
+    int events = atomic_read(&ch->irq_events);
+
+    mutex_lock(&ch->lock);
+    zfifo_chan_reap(this, ch);
+    if (req->done) break;
+    mutex_unlock(&ch->lock);
+
+    if (zfifo_chan_wait_event(this, ch, &wc, events, 0)){
+      mutex_lock(&ch->lock);
+      if (req->done) break;
+      req->owner  = NULL; // killed: let the completion free it
+      req->frames   = NULL; // owned by the caller
+      req->eof_desc = NULL;
+      req->ex       = NULL;
+      mutex_unlock(&ch->lock);
+      return -EINTR;
+    }
+  }
+
+  ch->perf.wait_ns += ktime_to_ns(ktime_sub(ktime_get(), t_wait));
+  result = zfifo_bounce_copyout(ch, req, req->result);
+  zfifo_req_free(ch, req);
+  mutex_unlock(&ch->lock);
+  return result;
+}
+
+// Leave a submitted request to complete on its own
+static void zfifo_req_abandon(zfifo_device_data* this, zfifo_req *req,
+                              enum dma_data_direction dir){
+  zfifo_chan *ch = zfifo_chan_of(this, dir);
+
+  mutex_lock(&ch->lock);
+  if (req->done){
+    zfifo_req_free(ch, req);
+  } else {
+    req->owner    = NULL;
+    req->frames   = NULL; // all owned by the caller
+    req->eof_desc = NULL;
+    req->ex       = NULL;
+  }
+  mutex_unlock(&ch->lock);
+}
+
+// Take a request that is still queued off its channel, so that it does
+// not take the data meant for the next one, and free it. The channel is
+// halted, the request's descriptors unlinked from the chain and the
+// rest restarted after it; it completes with err unless it finished.
+static void zfifo_req_cancel(zfifo_device_data* this, zfifo_req *req,
+                             enum dma_data_direction dir, long err){
+  zfifo_chan *ch = zfifo_chan_of(this, dir);
+  zfifo_req *prev, *first;
+  unsigned d;
+
+  mutex_lock(&ch->lock);
+  zfifo_chan_reap(this, ch);
+  if (req->done){
+    zfifo_req_free(ch, req);
+    mutex_unlock(&ch->lock);
+    return;
+  }
+  if (ch->running) zfifo_chan_halt(ch);
+
+  req->owner    = NULL; // freed by zfifo_req_complete()
+  req->frames   = NULL;
+  req->eof_desc = NULL;
+  req->ex       = NULL;
+  if (req->list.prev != &ch->active){
+    // the one before it goes on to the descriptor after it, and gives
+    // the slots back when it completes
+    dma_addr_t next_desc;
+
+    prev = list_prev_entry(req, list);
+    next_desc = ch->phys +
+      0x40 * ((req->first + req->nslots + req->hole) % ch->ndesc);
+    ch->desc[prev->last*16 +0] = LOW32 (next_desc);
+    ch->desc[prev->last*16 +1] = HIGH32(next_desc);
+    prev->hole += req->nslots + req->hole;
+    req->hole   = 0;
+    req->nslots = 0;
+  }
+  zfifo_req_complete(this, ch, req, err);
+
+  // retire what finished before the halt, restart at the first
+  // descriptor not done
+  zfifo_chan_reap(this, ch);
+  if (list_empty(&ch->active)){
+    if (!ch->ring) ch->head = 0;
+  } else if (!ch->running){ // unless reap restarted it after a short packet
+    first = list_first_entry(&ch->active, zfifo_req, list);
+    for (d=0; d<first->nslots - 1; d++)
+      if (!(ch->desc[((first->first + d) % ch->ndesc)*16 +7] &
+            DESC_STS_CMPLT))
+        break;
+    zfifo_chan_restart(ch, (first->first + d) % ch->ndesc,
+                       list_last_entry(&ch->active, zfifo_req, list)->last);
+  }
+  mutex_unlock(&ch->lock);
+}
+
+// Find a request by cookie (ch->lock held)
+static zfifo_req *zfifo_req_find(zfifo_chan *ch, struct file *file,
+                                 unsigned long long cookie){
+  zfifo_req *req;
+
+  list_for_each_entry(req, &ch->done, list)
+    if (req->cookie == cookie && req->owner == file) return req;
+  list_for_each_entry(req, &ch->active, list)
+    if (req->cookie == cookie && req->owner == file) return req;
+  return NULL;
+}
+
+#define ZFIFO_WAIT_MAX 1024
+
+// IOCTL_WAIT: collect results of submitted cookies, blocking until at
+// least min of them completed. Returns # of completed entries.
+static long zfifo_wait_cookies(zfifo_device_data* this, struct file *file,
+                               zfifo_wait_io __user *uwait){
+  zfifo_wait_io w;
+  zfifo_cpl *cpl;
+  zfifo_wait_ctx wc;
+  unsigned i, ncpl = 0;
+  long rc = 0;
+
+  if (copy_from_user(&w, uwait, sizeof(w)))
+    return -EFAULT;
+  if (w.n == 0 || w.n > ZFIFO_WAIT_MAX || w.min > w.n)
+    return -EINVAL;
+
+  if ((cpl = kmalloc_array(w.n, sizeof(*cpl), GFP_KERNEL)) == NULL)
+    return -ENOMEM;
+  if (copy_from_user(cpl, w.cpl, w.n * sizeof(*cpl))){
+    kfree(cpl);
+    return -EFAULT;
+  }
+  for (i=0; i<w.n; i++) cpl[i].result = ZFIFO_PENDING;
+  zfifo_wait_begin(this, &this->mm2s, 0, &wc);
+
+  for(;;){
+    int events[2];
+    int pending = 0; // channels still owing a completion
+
+    events[0] = atomic_read(&this->mm2s.irq_events);
+    events[1] = atomic_read(&this->s2mm.irq_events);
+
+    for (i=0; i<w.n; i++){
+      zfifo_chan *ch = (cpl[i].cookie & 1) ? &this->s2mm : &this->mm2s;
+      zfifo_req *req;
+
+      if (cpl[i].result != ZFIFO_PENDING) continue;
+
+      mutex_lock(&ch->lock);
+      zfifo_chan_reap(this, ch);
+      req = zfifo_req_find(ch, file, cpl[i].cookie);
+      if (req == NULL){
+        cpl[i].result = -ENOENT;
+        ncpl++;
+      } else if (req->done){
+        cpl[i].result = zfifo_bounce_copyout(ch, req, req->result);
+        zfifo_req_free(ch, req);
+        ncpl++;
+      } else {
+        pending |= (ch == &this->s2mm) ? 2 : 1;
+      }
+      mutex_unlock(&ch->lock);
+    }
+
+    if (ncpl >= w.min || pending == 0) break;
+
+    rc = zfifo_dev_wait_event(this, &wc, pending, events);
+    if (rc) break;
+  }
+
+  if (copy_to_user(w.cpl, cpl, w.n * sizeof(*cpl)))
+    rc = -EFAULT;
+  kfree(cpl);
+  return rc ? rc : ncpl;
+}
+
+// Give up on everything this file left in flight (on close)
+static void zfifo_chan_release(zfifo_device_data* this, zfifo_chan *ch,
+                               struct file *file){
+  zfifo_req *req, *tmp;
+
+  mutex_lock(&ch->lock);
+  zfifo_chan_reap(this, ch);
+  list_for_each_entry_safe(req, tmp, &ch->done, list){
+    if (req->owner == file)
+      zfifo_req_free(ch, req);
+  }
+  list_for_each_entry(req, &ch->active, list)
+    if (req->owner == file) req->owner = NULL;
+  mutex_unlock(&ch->lock);
+}
+
+// Fail everything queued (DMA already reset, on device destroy)
+static void zfifo_chan_flush(zfifo_device_data* this, zfifo_chan *ch){
+  zfifo_req *req, *tmp;
+
+  mutex_lock(&ch->lock);
+  list_for_each_entry_safe(req, tmp, &ch->active, list){
+    req->owner = NULL;
+    zfifo_req_complete(this, ch, req, -ECANCELED);
+  }
+  list_for_each_entry_safe(req, tmp, &ch->done, list)
+    zfifo_req_free(ch, req);
+  ch->running = 0;
+  ch->head    = 0;
+  ch->used    = 0;
+  mutex_unlock(&ch->lock);
+}
+
+// Retire completions after an interrupt so that eventfds get signalled
+// and kiocbs completed without anybody waiting in the driver
+static void zfifo_reap_work(struct work_struct *work){
+  zfifo_device_data* this = container_of(work, zfifo_device_data, reap_work);
+
+  mutex_lock(&this->mm2s.lock);
+  zfifo_chan_reap(this, &this->mm2s);
+  mutex_unlock(&this->mm2s.lock);
+
+  mutex_lock(&this->s2mm.lock);
+  zfifo_chan_reap(this, &this->s2mm);
+  mutex_unlock(&this->s2mm.lock);
+}
+
+// ----------------------------------------------------------------------
+// Chunked transfers: a send/recv over chunk_size goes in chunks of one
+// packet, the next chunk pinned, mapped and described while the DMA
+// runs the current one, so neither the size of the descriptor area nor
+// the pinning of the whole buffer holds the first byte back.
+
+// Request for one chunk, descriptors prebuilt in a shadow, not queued yet
+static zfifo_req *zfifo_req_new_chunk(zfifo_device_data* this,
+                                      struct file *file,
+                                      char __user *bufp, unsigned long len,
+                                      enum dma_data_direction dir,
+                                      int chunk){
+  zfifo_reg_buf *rb;
+  zfifo_req *req;
+
+  rb = zfifo_reg_buf_alloc(this, bufp, len, dir);
+  if (IS_ERR(rb)) return ERR_CAST(rb);
+  rb->busy = 1; // owner NULL: freed on completion
+
+  if ((req = kzalloc(sizeof(*req), GFP_KERNEL)) == NULL){
+    zfifo_reg_buf_put(this, rb);
+    return ERR_PTR(-ENOMEM);
+  }
+  req->owner = file;
+  req->len   = len;
+  req->rb    = rb;
+  req->chunk = chunk;
+  return req;
+}
+
+// MM2S: close a packet that a failed chunked send left without TLAST,
+// with one zero word carrying TLAST, so that the next send starts a new
+// packet in the PL. It takes a bounce slot; without a bounce pool (or on
+// a fatal signal) the stream stays broken and that is logged.
+static void zfifo_chunk_terminate(zfifo_device_data* this){
+  zfifo_chan *ch = &this->mm2s;
+  zfifo_wait_ctx wc;
+  zfifo_req *req;
+  int slot;
+
+  if (ch->bounce == NULL || (req = kzalloc(sizeof(*req), GFP_KERNEL)) == NULL)
+    goto broken;
+
+  zfifo_wait_begin(this, ch, 0, &wc);
+  for(;;){
+    int events = atomic_read(&ch->irq_events);
+
+    mutex_lock(&ch->lock);
+    zfifo_chan_reap(this, ch);
+    slot = zfifo_bounce_get(ch);
+    mutex_unlock(&ch->lock);
+    if (slot != 0) break;
+    if (zfifo_chan_wait_event(this, ch, &wc, events, 0)){
+      kfree(req);
+      goto broken;
+    }
+  }
+  req->owner  = NULL; // nobody waits: freed on completion
+  req->len    = 4;
+  req->bounce = slot;
+  req->chunk  = ZFIFO_CHUNK_CONT;
+  memset(zfifo_bounce_buf(ch, req), 0, req->len);
+  if (zfifo_queue(this, req, DMA_TO_DEVICE, 0) == 0)
+    return;
+
+ broken:
+  dev_err(this->sys_dev, "MM2S: chunked send failed, packet left without "
+          "TLAST\n");
+}
+
+// One packet of len bytes in chunks. MM2S keeps two chunks queued; S2MM
+// queues the next chunk only after the current one filled up without
+// TLAST, else it would take the head of the next packet. Returns 0 for
+// a send, bytes received for a receive.
+static long zfifo_xfer_chunked(zfifo_device_data* this, struct file *file,
+                               char __user *bufp, unsigned long len,
+                               enum dma_data_direction dir,
+                               unsigned *eof_desc, zfifo_io_ex *ex){
+  zfifo_chan *ch = zfifo_chan_of(this, dir);
+  zfifo_req *req, *busy = NULL; // busy: queued, not waited for yet
+  unsigned long off, n, total = 0;
+  unsigned nslots = 0, busy_nslots = 0, eop = ~0u;
+  int unterminated = 0; // MM2S: chunks without TLAST on the ring
+  long rc = 0;
+
+  for (off = 0; off < len; off += n){
+    n = min_t(unsigned long, len - off, chunk_size);
+
+    req = zfifo_req_new_chunk(this, file, bufp + off, n, dir,
+                              ((off != 0)    ? ZFIFO_CHUNK_CONT : 0) |
+                              ((off+n < len) ? ZFIFO_CHUNK_MORE : 0));
+    if (IS_ERR(req)){
+      rc = PTR_ERR(req);
+      break;
+    }
+
+    if (dir == DMA_FROM_DEVICE && busy != NULL){
+      rc = zfifo_req_wait(this, busy, dir);
+      busy = NULL;
+      if (rc >= 0){
+        total += rc;
+        if (eop == ~0u) nslots += busy_nslots;
+      }
+      if (rc < 0 || eop != ~0u){ // failed or the packet ended
+        zfifo_req_discard(this, ch, req);
+        break;
+      }
+    }
+
+    busy_nslots = req->rb->sg_map->num_sg;
+    if (dir == DMA_FROM_DEVICE) req->eof_desc = &eop;
+    req->ex = ex;
+    if ((rc = zfifo_queue(this, req, dir, 0)) != 0) break;
+    unterminated = (off+n < len);
+
+    if (busy != NULL){ // MM2S: the previous chunk
+      rc = zfifo_req_wait(this, busy, dir);
+      if (rc < 0){
+        busy = req;
+        break;
+      }
+    }
+    busy = req;
+  }
+
+  if (busy != NULL){
+    if (rc >= 0){
+      rc = zfifo_req_wait(this, busy, dir);
+      if (rc >= 0 && dir == DMA_FROM_DEVICE){
+        total += rc;
+        if (eop == ~0u) nslots += busy_nslots;
+      }
+    } else {
+      zfifo_req_abandon(this, busy, dir);
+    }
+  }
+
+  if (rc < 0 && unterminated && dir == DMA_TO_DEVICE)
+    zfifo_chunk_terminate(this);
+  if (rc < 0) return rc;
+  if (dir == DMA_TO_DEVICE) return 0;
+  if (eof_desc != NULL)
+    *eof_desc = nslots + ((eop == ~0u) ? 0 : eop);
+  return total;
+}
+
+// ----------------------------------------------------------------------
+// Send/Recv
+
+// Receive one packet of up to len bytes. Returns the bytes received and
+// the descriptor (from 0) the packet ended in. ex (zeroed by the caller)
+// gets the report of the transfer.
+static long zfifo_recv(zfifo_device_data* this, struct file *file,
+                       char __user *bufp, unsigned long len,
+                       unsigned *eof_desc, zfifo_io_ex *ex){
+  zfifo_req *req;
+
+  long rc;
+
+  if (chunk_size != 0 && len > chunk_size)
+    return zfifo_xfer_chunked(this, file, bufp, len, DMA_FROM_DEVICE,
+                              eof_desc, ex);
+
+  req = zfifo_req_new_user(this, file, bufp, len, DMA_FROM_DEVICE, 1);
+  if (IS_ERR(req)) return PTR_ERR(req);
+  req->eof_desc = eof_desc;
+  req->ex       = ex;
+
+  rc = zfifo_queue(this, req, DMA_FROM_DEVICE, 0);
+  return rc ? rc : zfifo_req_wait(this, req, DMA_FROM_DEVICE);
+}
+
+
+static int zfifo_send(zfifo_device_data* this, struct file *file,
+                      char __user *bufp, unsigned long len,
+                      zfifo_io_ex *ex){
+  zfifo_req *req;
+  int rc;
+
+  if (chunk_size != 0 && len > chunk_size)
+    return zfifo_xfer_chunked(this, file, bufp, len, DMA_TO_DEVICE,
+                              NULL, ex);
+
+  req = zfifo_req_new_user(this, file, bufp, len, DMA_TO_DEVICE, 1);
+  if (IS_ERR(req)) return PTR_ERR(req);
+  req->ex = ex;
+
+  rc = zfifo_queue(this, req, DMA_TO_DEVICE, 0);
+  return rc ? rc : zfifo_req_wait(this, req, DMA_TO_DEVICE);
+} 
+
+// Send and receive in one call: S2MM is armed before MM2S starts, so
+// request/response cores need no second thread. Returns bytes received.
+static long zfifo_xfer(zfifo_device_data* this, struct file *file,
+                       char __user *txp, unsigned long txlen,
+                       char __user *rxp, unsigned long rxlen){
+  zfifo_req *rx = NULL, *tx = NULL;
+  long rc_tx = 0, rc_rx = 0;
+
+  if (rxlen != 0){
+    rx = zfifo_submit(this, file, DMA_FROM_DEVICE, rxp, rxlen, -1);
+    if (IS_ERR(rx)) return PTR_ERR(rx);
+  }
+
+  if (txlen != 0){
+    tx = zfifo_submit(this, file, DMA_TO_DEVICE, txp, txlen, -1);
+    if (IS_ERR(tx)){
+      if (rx != NULL)
+        zfifo_req_cancel(this, rx, DMA_FROM_DEVICE, -ECANCELED);
+      return PTR_ERR(tx);
+    }
+    rc_tx = zfifo_req_wait(this, tx, DMA_TO_DEVICE);
+  }
+
+  if (rx != NULL){
+    if (rc_tx == 0)
+      rc_rx = zfifo_req_wait(this, rx, DMA_FROM_DEVICE);
+    else // no answer is coming: unarm S2MM for the next transfer
+      zfifo_req_cancel(this, rx, DMA_FROM_DEVICE, -ECANCELED);
+  }
+
+  return rc_tx ? rc_tx : rc_rx;
+}
+
+static int zfifo_xfer_reg(zfifo_device_data* this, struct file *file,
+                          int handle, unsigned long len,
+                          enum dma_data_direction dir){
+  zfifo_req *req;
+
+  req = zfifo_submit(this, file, dir, NULL, len, handle);
+  if (IS_ERR(req)) return PTR_ERR(req);
+
+  return zfifo_req_wait(this, req, dir);
+}
+
+// Request for the user pages behind an iov_iter, not queued yet
+static zfifo_req *zfifo_req_new_iter(zfifo_device_data* this,
+                                     struct iov_iter *iter,
+                                     enum dma_data_direction dir){
+  zfifo_req *req;
+
+  if ((req = kzalloc(sizeof(*req), GFP_KERNEL)) == NULL)
+    return ERR_PTR(-ENOMEM);
+  req->len    = iov_iter_count(iter);
+  req->sg_map = alloc_sg_iter(this, iter, dir);
+  if (req->sg_map == NULL){
+    kfree(req);
+    return ERR_PTR(-EFAULT);
+  }
+  return req;
+}
+
+#define ZFIFO_IOV_MAX 1024
+
+// IOCTL_SENDV/RECVV: the segments are gathered into (scattered from) one
+// packet, SOF on the first and EOF on the last descriptor only
+static int zfifo_xferv(zfifo_device_data* this, struct file *file,
+                       const zfifo_io __user *useg, unsigned nseg,
+                       enum dma_data_direction dir){
+  struct iovec *iov;
+  struct iov_iter iter;
+  zfifo_req *req;
+  size_t total = 0;
+  unsigned i;
+  int rc = 0;
+
+  if (nseg == 0 || nseg > ZFIFO_IOV_MAX) return -EINVAL;
+  if ((iov = kmalloc_array(nseg, sizeof(*iov), GFP_KERNEL)) == NULL)
+    return -ENOMEM;
+
+  for (i=0; i<nseg; i++){
+    zfifo_io seg;
+    if (copy_from_user(&seg, &useg[i], sizeof(seg))){
+      rc = -EFAULT;
+      goto out;
+    }
+    if (((dma_addr_t)seg.data & 0x3) || (seg.len & 0x3) ||
+        seg.len > MAX_RW_COUNT - total){
+      printk(KERN_ERR "zfifo: segments must be 4n bytes, "
+             "32bit word aligned.\n");
+      rc = -EINVAL;
+      goto out;
+    }
+    iov[i].iov_base = (void __user *)seg.data;
+    iov[i].iov_len  = seg.len;
+    total += seg.len;
+  }
+  if (total == 0) goto out;
+
+  iov_iter_init(&iter, (dir == DMA_TO_DEVICE) ? WRITE : READ,
+                iov, nseg, total);
+  req = zfifo_req_new_iter(this, &iter, dir);
+  if (IS_ERR(req)){
+    rc = PTR_ERR(req);
+    goto out;
+  }
+  req->owner = file;
+
+  rc = zfifo_queue(this, req, dir, 0);
+  if (rc == 0)
+    rc = zfifo_req_wait(this, req, dir);
+
+ out:
+  kfree(iov);
+  return rc;
+}
+
+// IOCTL_SEND_FRAMES: one chain with TLAST at every frame bytes.
+// IOCTL_RECV_FRAMES: the same for S2MM, returns # of packets received and
+// their offsets/lengths. A packet shorter than frame moves the next one
+// to the following descriptor, not to the next frame boundary.
+static long zfifo_xfer_frames(zfifo_device_data* this, struct file *file,
+                              zfifo_frame_io *fio,
+                              enum dma_data_direction dir){
+  zfifo_frame *frames = NULL;
+  unsigned nframes;
+  zfifo_req *req;
+  long rc;
+
+  if (fio->frame == 0 || fio->frame > this->dmac_buf_len)
+    return -EINVAL;
+  nframes = DIV_ROUND_UP(fio->len, fio->frame);
+  if (nframes > zfifo_chan_of(this, dir)->ndesc)
+    return -E2BIG;
+
+  if (dir == DMA_FROM_DEVICE){
+    frames = kvcalloc(nframes, sizeof(*frames), GFP_KERNEL);
+    if (frames == NULL) return -ENOMEM;
+  }
+
+  req = zfifo_req_new_user(this, file, fio->data, fio->len, dir, 0);
+  if (IS_ERR(req)){
+    kvfree(frames);
+    return PTR_ERR(req);
+  }
+  req->frame   = fio->frame;
+  req->frames  = frames;
+  req->nframes = nframes;
+
+  rc = zfifo_queue(this, req, dir, 0);
+  if (rc == 0)
+    rc = zfifo_req_wait(this, req, dir);
+
+  if (rc > 0 && copy_to_user(fio->frames, frames,
+                             min_t(long, rc, nframes) * sizeof(*frames)))
+    rc = -EFAULT;
+  kvfree(frames);
+  return rc;
+}
+
+// read()/write() and readv()/writev(): one packet per call on the same
+// zero-copy path. Without a sync kiocb (aio, io_uring) the request is
+// completed by ki_complete() from the IRQ driven reaper.
+static ssize_t zfifo_rw_iter(struct kiocb *iocb, struct iov_iter *iter,
+                             enum dma_data_direction dir){
+  zfifo_device_data* this = iocb->ki_filp->private_data;
+  size_t len = iov_iter_count(iter);
+  zfifo_req *req;
+  int async;
+  long rc;
+
+  if (len == 0) return 0;
+  if ((len | iov_iter_alignment(iter)) & 3)
+    return -EINVAL;
+
+  req = zfifo_req_new_iter(this, iter, dir);
+  if (IS_ERR(req)) return PTR_ERR(req);
+
+  // no IRQ, no reaper: complete synchronously
+  async = !is_sync_kiocb(iocb) && zfifo_chan_of(this, dir)->irq != 0;
+  if (async){
+    req->iocb = iocb;   // owner NULL: freed on completion
+    atomic_inc(&this->nr_async);
+  } else {
+    req->owner = iocb->ki_filp;
+  }
+
+  rc = zfifo_queue(this, req, dir, iocb->ki_flags & IOCB_NOWAIT);
+  if (rc){
+    if (async) atomic_dec(&this->nr_async);
+    return rc;
+  }
+  if (async) return -EIOCBQUEUED;
+
+  rc = zfifo_req_wait(this, req, dir);
+  return (rc || dir == DMA_FROM_DEVICE) ? rc : (ssize_t)len;
+}
+
+static ssize_t zfifo_read_iter(struct kiocb *iocb, struct iov_iter *to){
+  return zfifo_rw_iter(iocb, to, DMA_FROM_DEVICE);
+}
+
+static ssize_t zfifo_write_iter(struct kiocb *iocb, struct iov_iter *from){
+  return zfifo_rw_iter(iocb, from, DMA_TO_DEVICE);
+}
+
+// ----------------------------------------------------------------------
+// Device file operations
+
+static int zfifo_open(struct inode *inode, struct file *file){
+  zfifo_device_data* this;
+  int status = 0;
+
+  this = container_of(inode->i_cdev, zfifo_device_data, cdev);
+  if (!atomic_inc_unless_negative(&this->nr_open))
+    return -EBUSY; // the in-kernel benchmark has the device
+  file->private_data = this;
+  this->is_open = 1;
+#ifdef DEBUG_ZFIFO
+  dev_dbg(this->sys_dev, "open: DMA regs at %pa\n", &this->dma_regs_phys);
+#endif
+  
+  return status;
+}
+
+static int zfifo_release(struct inode *inode, struct file *file){
+  zfifo_device_data* this = file->private_data;
+
+#ifdef DEBUG_ZFIFO
+  dev_dbg(this->sys_dev, "close: DMA regs at %pa\n", &this->dma_regs_phys);
+#endif
+  zfifo_chan_release(this, &this->mm2s, file);
+  zfifo_chan_release(this, &this->s2mm, file);
+  zfifo_reg_buf_release_all(this, file);
+  zfifo_pin_release_all(this, file);
+  flush_work(&this->unpin_work); // the file's pages are unpinned on close
+  zfifo_evfd_set(this, file, -1);
+  mutex_lock(&this->s2mm.lock);
+  if (this->rxring != NULL && this->rxring->owner == file)
+    zfifo_rxring_stop(this);
+  mutex_unlock(&this->s2mm.lock);
+  if (this->bypass != NULL && this->bypass->owner == file)
+    zfifo_bypass_stop(this);
+  this->is_open = 0;
+  atomic_dec(&this->nr_open);
+
+  return 0;
+}
+
+static long zfifo_ioctl(struct file *file, unsigned int ioctlnum,
+                       unsigned long param){
+
+  zfifo_device_data* this = file->private_data;
+  zfifo_io zio;
+
+  // Get user parameters and check them
+  if (ioctlnum == IOCTL_SEND || ioctlnum == IOCTL_RECV){
+    if (copy_from_user(&zio, (void *)param, sizeof(zfifo_io))) {
+      printk(KERN_ERR "zfifo: cannot read ioctl user parameter.\n");
+      return -EFAULT;
+    }
+
+    // Check parameters
+    if ((dma_addr_t)zio.data & 0x3){
+      printk(KERN_ERR "zfifo: user buffer must be 32bit word aligned.\n");
+      return -EINVAL;
+    }
+
+    if (zio.len & 0x3){
+      printk(KERN_ERR "zfifo: transfer length must be 4n bytes.\n");
+      return -EINVAL;
+    }
+
+    // no len=0 transger
+    if (zio.len == 0) return 0;
+  }
+
+  // IOCTLs
+  switch(ioctlnum){
+  case IOCTL_SEND:
+    return zfifo_send(this, file, zio.data, zio.len, NULL);
+      
+  case IOCTL_RECV:
+    return zfifo_recv(this, file, zio.data, zio.len, NULL, NULL);
+
+  case IOCTL_SEND_EX:
+  case IOCTL_RECV_EX: {
+    zfifo_io_ex ex;
+    long rc = 0;
+    if (copy_from_user(&ex, (void *)param, sizeof(ex)))
+      return -EFAULT;
+    if (((dma_addr_t)ex.data & 0x3) || (ex.len & 0x3)){
+      printk(KERN_ERR "zfifo: transfer must be 4n bytes, "
+             "32bit word aligned.\n");
+      return -EINVAL;
+    }
+    ex.actual = 0;
+    ex.ndesc  = 0;
+    ex.dmasr  = 0;
+    ex.t_submit = ex.t_start = ex.t_irq = 0;
+    if (ex.len != 0){
+      if (ioctlnum == IOCTL_SEND_EX)
+        rc = zfifo_send(this, file, ex.data, ex.len, &ex);
+      else
+        rc = zfifo_recv(this, file, ex.data, ex.len, NULL, &ex);
+    }
+    ex.t_return = ktime_get_ns();
+    if ((rc >= 0 || rc == -EIO) &&
+        copy_to_user((void *)param, &ex, sizeof(ex)))
+      return -EFAULT;
+    return rc;
+  }
+
+  case IOCTL_RECV_EOP: {
+    zfifo_recv_io rio;
+    long rc;
+    if (copy_from_user(&rio, (void *)param, sizeof(rio)))
+      return -EFAULT;
+    if (((dma_addr_t)rio.data & 0x3) || (rio.len & 0x3) || rio.len == 0){
+      printk(KERN_ERR "zfifo: transfer must be 4n bytes, "
+             "32bit word aligned.\n");
+      return -EINVAL;
+    }
+    rc = zfifo_recv(this, file, rio.data, rio.len, &rio.eof_desc, NULL);
+    if (rc >= 0 &&
+        copy_to_user(&((zfifo_recv_io __user *)param)->eof_desc,
+                     &rio.eof_desc, sizeof(rio.eof_desc)))
+      return -EFAULT;
+    return rc;
+  }
+
+  case IOCTL_RESET:
+    return zfifo_dmac_recover(this, 1);
+
+  case IOCTL_REG_BUF: {
+    zfifo_reg reg;
+    if (copy_from_user(&reg, (void *)param, sizeof(reg)))
+      return -EFAULT;
+    if (((dma_addr_t)reg.data & 0x3) || (reg.len & 0x3) || reg.len == 0){
+      printk(KERN_ERR "zfifo: registered buffer must be 4n bytes, "
+             "32bit word aligned.\n");
+      return -EINVAL;
+    }
+    return zfifo_reg_buf_create(this, file, reg.data, reg.len, reg.flags);
+  }
+
+  case IOCTL_UNREG_BUF:
+    return zfifo_reg_buf_destroy(this, file, (int)param);
+
+  case IOCTL_SEND_REG:
+  case IOCTL_RECV_REG: {
+    zfifo_reg_io rio;
+    if (copy_from_user(&rio, (void *)param, sizeof(rio)))
+      return -EFAULT;
+    if (rio.len & 0x3){
+      printk(KERN_ERR "zfifo: transfer length must be 4n bytes.\n");
+      return -EINVAL;
+    }
+    return zfifo_xfer_reg(this, file, rio.handle, rio.len,
+                          (ioctlnum == IOCTL_SEND_REG) ?
+                          DMA_TO_DEVICE : DMA_FROM_DEVICE);
+  }
+
+  case IOCTL_SUBMIT_SEND:
+  case IOCTL_SUBMIT_RECV: {
+    zfifo_async_io aio;
+    zfifo_req *req;
+    enum dma_data_direction dir = (ioctlnum == IOCTL_SUBMIT_SEND) ?
+      DMA_TO_DEVICE : DMA_FROM_DEVICE;
+
+    if (copy_from_user(&aio, (void *)param, sizeof(aio)))
+      return -EFAULT;
+    if (((dma_addr_t)aio.data & 0x3) || (aio.len & 0x3) ||
+        (aio.data != NULL && aio.len == 0)){
+      printk(KERN_ERR "zfifo: transfer must be 4n bytes, "
+             "32bit word aligned.\n");
+      return -EINVAL;
+    }
+
+    req = zfifo_submit(this, file, dir, aio.data, aio.len, aio.handle);
+    if (IS_ERR(req)) return PTR_ERR(req);
+
+    aio.cookie = req->cookie; // req lives until its cookie is waited for
+    if (copy_to_user(&((zfifo_async_io __user *)param)->cookie,
+                     &aio.cookie, sizeof(aio.cookie)))
+      return -EFAULT;
+    return 0;
+  }
+
+  case IOCTL_SENDV:
+  case IOCTL_RECVV: {
+    zfifo_iov_io vio;
+    if (copy_from_user(&vio, (void *)param, sizeof(vio)))
+      return -EFAULT;
+    return zfifo_xferv(this, file, vio.seg, vio.nseg,
+                       (ioctlnum == IOCTL_SENDV) ?
+                       DMA_TO_DEVICE : DMA_FROM_DEVICE);
+  }
+
+  case IOCTL_SEND_FRAMES:
+  case IOCTL_RECV_FRAMES: {
+    zfifo_frame_io fio;
+    if (copy_from_user(&fio, (void *)param, sizeof(fio)))
+      return -EFAULT;
+    if (((dma_addr_t)fio.data & 0x3) || (fio.len & 0x3) ||
+        (fio.frame & 0x3) || fio.len == 0){
+      printk(KERN_ERR "zfifo: transfer and frame must be 4n bytes, "
+             "32bit word aligned.\n");
+      return -EINVAL;
+    }
+    return zfifo_xfer_frames(this, file, &fio,
+                             (ioctlnum == IOCTL_SEND_FRAMES) ?
+                             DMA_TO_DEVICE : DMA_FROM_DEVICE);
+  }
+
+  case IOCTL_BYPASS_SETUP: {
+    zfifo_bypass_setup su;
+    if (copy_from_user(&su, (void *)param, sizeof(su)))
+      return -EFAULT;
+    return zfifo_bypass_start(this, file, &su);
+  }
+
+  case IOCTL_BYPASS_WAKEUP:
+    if (this->bypass == NULL || this->bypass->owner != file)
+      return -EINVAL;
+    wake_up_process(this->bypass->thread);
+    return 0;
+
+  case IOCTL_WAIT:
+    return zfifo_wait_cookies(this, file, (zfifo_wait_io __user *)param);
+
+  case IOCTL_SET_EVENTFD:
+    return zfifo_evfd_set(this, file, (int)param);
+
+  case IOCTL_XFER: {
+    zfifo_xfer_io xio;
+    if (copy_from_user(&xio, (void *)param, sizeof(xio)))
+      return -EFAULT;
+    if (((dma_addr_t)xio.txdata & 0x3) || ((dma_addr_t)xio.rxdata & 0x3) ||
+        (xio.txlen & 0x3) || (xio.rxlen & 0x3)){
+      printk(KERN_ERR "zfifo: transfer must be 4n bytes, "
+             "32bit word aligned.\n");
+      return -EINVAL;
+    }
+    return zfifo_xfer(this, file, xio.txdata, xio.txlen,
+                      xio.rxdata, xio.rxlen);
+  }
+    
+  default:
+    return -ENOTTY;
+  }
+  return 0;
+}
+
+// POLLOUT: MM2S can queue a transfer, POLLIN: an S2MM transfer of this
+// file completed (collect it with IOCTL_WAIT) or its receive ring has
+// packets. Needs the S2MM/MM2S IRQs.
+static __poll_t zfifo_poll(struct file *file, poll_table *wait){
+  zfifo_device_data* this = file->private_data;
+  __poll_t mask = 0;
+  zfifo_req *req;
+
+  poll_wait(file, &this->waitq, wait);
+
+  mutex_lock(&this->mm2s.lock);
+  zfifo_chan_reap(this, &this->mm2s);
+  if (zfifo_chan_reserve(&this->mm2s, 1) >= 0)
+    mask |= POLLOUT | POLLWRNORM;
+  mutex_unlock(&this->mm2s.lock);
+
+  mutex_lock(&this->s2mm.lock);
+  zfifo_chan_reap(this, &this->s2mm);
+  if (this->rxring != NULL && this->rxring->owner == file){
+    if (this->rxring->prod != READ_ONCE(this->rxring->ctl->cons))
+      mask |= POLLIN | POLLRDNORM;
+    if (this->rxring->error)
+      mask |= POLLERR;
+  }
+  list_for_each_entry(req, &this->s2mm.done, list){
+    if (req->owner == file){
+      mask |= POLLIN | POLLRDNORM;
+      break;
+    }
+  }
+  mutex_unlock(&this->s2mm.lock);
+
+  return mask;
+}
+
+// mmap() at ZFIFO_MMAP_RXRING maps the receive ring (zfifo_rxring, then
+// the slots), starting it on the first call. ZFIFO_MMAP_BYPASS_* map the
+// regions of the kernel-bypass queues after IOCTL_BYPASS_SETUP.
+static int zfifo_mmap(struct file *file, struct vm_area_struct *vma){
+  zfifo_device_data* this = file->private_data;
+  unsigned long size = vma->vm_end - vma->vm_start;
+  unsigned long region = vma->vm_pgoff << PAGE_SHIFT;
+  int rc = 0;
+
+  if (region != ZFIFO_MMAP_RXRING){
+    zfifo_bypass *bp = this->bypass;
+    if (bp == NULL || bp->owner != file) return -EINVAL;
+    return zfifo_bypass_mmap(this, bp, vma, region);
+  }
+
+  mutex_lock(&this->s2mm.lock);
+  if (this->rxring == NULL)
+    rc = zfifo_rxring_start(this, file);
+  else if (this->rxring->owner != file)
+    rc = -EBUSY;
+  if (rc == 0 && size > this->rxring->size)
+    rc = -EINVAL;
+  if (rc == 0)
+    rc = dma_mmap_coherent(this->dma_dev, vma, this->rxring->ctl,
+                           this->rxring->dma, size);
+  mutex_unlock(&this->s2mm.lock);
+  return rc;
+}
+
+static const struct file_operations zfifo_file_ops =
+  {
+   .owner   = THIS_MODULE,
+   .open    = zfifo_open,
+   .release = zfifo_release,
+   .poll    = zfifo_poll,
+   .mmap    = zfifo_mmap,
+   .read_iter  = zfifo_read_iter,
+   .write_iter = zfifo_write_iter,
+   .unlocked_ioctl = zfifo_ioctl
+};
+
+// ------------------------------------------------------------
+// sysfs attributes (/sys/class/zfifo/zfifoN/)
+
+static ssize_t irq_threshold_show(struct device *dev,
+                                  struct device_attribute *attr, char *buf){
+  zfifo_device_data* this = dev_get_drvdata(dev);
+  return sprintf(buf, "%u\n", this->irq_threshold);
+}
+
+static ssize_t irq_threshold_store(struct device *dev,
+                                   struct device_attribute *attr,
+                                   const char *buf, size_t count){
+  zfifo_device_data* this = dev_get_drvdata(dev);
+  unsigned val;
+  int rc;
+
+  if ((rc = kstrtouint(buf, 0, &val)) != 0) return rc;
+  if ((rc = zfifo_set_coalesce(this, val, this->irq_delay)) != 0) return rc;
+  return count;
+}
+static DEVICE_ATTR_RW(irq_threshold);
+
+static ssize_t irq_delay_show(struct device *dev,
+                              struct device_attribute *attr, char *buf){
+  zfifo_device_data* this = dev_get_drvdata(dev);
+  return sprintf(buf, "%u\n", this->irq_delay);
+}
+
+static ssize_t irq_delay_store(struct device *dev,
+                               struct device_attribute *attr,
+                               const char *buf, size_t count){
+  zfifo_device_data* this = dev_get_drvdata(dev);
+  unsigned val;
+  int rc;
+
+  if ((rc = kstrtouint(buf, 0, &val)) != 0) return rc;
+  if ((rc = zfifo_set_coalesce(this, this->irq_threshold, val)) != 0)
+    return rc;
+  return count;
+}
+static DEVICE_ATTR_RW(irq_delay);
+
+static ssize_t wait_policy_show(struct device *dev,
+                                struct device_attribute *attr, char *buf){
+  zfifo_device_data* this = dev_get_drvdata(dev);
+  return sprintf(buf, "%s\n", zfifo_wait_policy_name[this->wait_policy]);
+}
+
+static ssize_t wait_policy_store(struct device *dev,
+                                 struct device_attribute *attr,
+                                 const char *buf, size_t count){
+  zfifo_device_data* this = dev_get_drvdata(dev);
+  unsigned i;
+
+  for (i=0; i<ARRAY_SIZE(zfifo_wait_policy_name); i++){
+    if (sysfs_streq(buf, zfifo_wait_policy_name[i])){
+      this->wait_policy = i;
+      return count;
+    }
+  }
+  return -EINVAL;
+}
+static DEVICE_ATTR_RW(wait_policy);
+
+static ssize_t poll_us_show(struct device *dev,
+                            struct device_attribute *attr, char *buf){
+  zfifo_device_data* this = dev_get_drvdata(dev);
+  return sprintf(buf, "%u\n", this->poll_us);
+}
+
+static ssize_t poll_us_store(struct device *dev,
+                             struct device_attribute *attr,
+                             const char *buf, size_t count){
+  zfifo_device_data* this = dev_get_drvdata(dev);
+  unsigned val;
+  int rc;
+
+  if ((rc = kstrtouint(buf, 0, &val)) != 0) return rc;
+  this->poll_us = val;
+  return count;
+}
+static DEVICE_ATTR_RW(poll_us);
+
+// receive ring geometry, applied by the next mmap()
+static ssize_t rxring_slots_show(struct device *dev,
+                                 struct device_attribute *attr, char *buf){
+  zfifo_device_data* this = dev_get_drvdata(dev);
+  return sprintf(buf, "%u\n", this->rxring_slots);
+}
+
+static ssize_t rxring_slots_store(struct device *dev,
+                                  struct device_attribute *attr,
+                                  const char *buf, size_t count){
+  zfifo_device_data* this = dev_get_drvdata(dev);
+  unsigned val;
+  int rc;
+
+  if ((rc = kstrtouint(buf, 0, &val)) != 0) return rc;
+  if (val == 0 || val > this->s2mm.ndesc) return -EINVAL;
+  this->rxring_slots = val;
+  return count;
+}
+static DEVICE_ATTR_RW(rxring_slots);
+
+static ssize_t rxring_slot_size_show(struct device *dev,
+                                     struct device_attribute *attr,
+                                     char *buf){
+  zfifo_device_data* this = dev_get_drvdata(dev);
+  return sprintf(buf, "%u\n", this->rxring_slot_size);
+}
+
+static ssize_t rxring_slot_size_store(struct device *dev,
+                                      struct device_attribute *attr,
+                                      const char *buf, size_t count){
+  zfifo_device_data* this = dev_get_drvdata(dev);
+  unsigned val;
+  int rc;
+
+  if ((rc = kstrtouint(buf, 0, &val)) != 0) return rc;
+  if (val == 0 || (val & 0x3) || val >= this->dmac_buf_len) return -EINVAL;
+  this->rxring_slot_size = val;
+  return count;
+}
+static DEVICE_ATTR_RW(rxring_slot_size);
+
+static ssize_t bounce_threshold_show(struct device *dev,
+                                     struct device_attribute *attr,
+                                     char *buf){
+  zfifo_device_data* this = dev_get_drvdata(dev);
+  return sprintf(buf, "%u\n", this->bounce_threshold);
+}
+
+static ssize_t bounce_threshold_store(struct device *dev,
+                                      struct device_attribute *attr,
+                                      const char *buf, size_t count){
+  zfifo_device_data* this = dev_get_drvdata(dev);
+  unsigned val;
+  int rc;
+
+  if ((rc = kstrtouint(buf, 0, &val)) != 0) return rc;
+  if (val > this->mm2s.bounce_size) return -EINVAL;
+  this->bounce_threshold = val;
+  return count;
+}
+static DEVICE_ATTR_RW(bounce_threshold);
+
+static ssize_t defer_unpin_show(struct device *dev,
+                                struct device_attribute *attr, char *buf){
+  zfifo_device_data* this = dev_get_drvdata(dev);
+  return sprintf(buf, "%u\n", this->defer_unpin);
+}
+
+static ssize_t defer_unpin_store(struct device *dev,
+                                 struct device_attribute *attr,
+                                 const char *buf, size_t count){
+  zfifo_device_data* this = dev_get_drvdata(dev);
+  unsigned val;
+  int rc;
+
+  if ((rc = kstrtouint(buf, 0, &val)) != 0) return rc;
+  this->defer_unpin = (val != 0);
+  if (!this->defer_unpin)
+    flush_work(&this->unpin_work);
+  return count;
+}
+static DEVICE_ATTR_RW(defer_unpin);
+
+static ssize_t stats_show(struct device *dev,
+                          struct device_attribute *attr, char *buf){
+  zfifo_device_data* this = dev_get_drvdata(dev);
+  int len = 0;
+
+  len += sprintf(buf+len, "irq_threshold %u\n", this->irq_threshold);
+  len += sprintf(buf+len, "irq_delay %u\n", this->irq_delay);
+  len += sprintf(buf+len, "wait_policy %s\n",
+                 zfifo_wait_policy_name[this->wait_policy]);
+  len += sprintf(buf+len, "poll_us %u\n", this->poll_us);
+  len += sprintf(buf+len, "cache_mode %s\n",
+                 this->coherent ? "coherent" : "streaming");
+  len += sprintf(buf+len, "bounce_threshold %u\n", this->bounce_threshold);
+  len += sprintf(buf+len, "mm2s_irqs %u\n",
+                 atomic_read(&this->mm2s.irq_events));
+  len += sprintf(buf+len, "mm2s_completed %llu\n", this->mm2s.completed);
+  len += sprintf(buf+len, "mm2s_sleeps %llu\n", this->mm2s.sleeps);
+  len += sprintf(buf+len, "mm2s_bw_MBps %lu\n", this->mm2s.bw);
+  len += sprintf(buf+len, "mm2s_bounced %llu\n", this->mm2s.bounced);
+  len += sprintf(buf+len, "s2mm_irqs %u\n",
+                 atomic_read(&this->s2mm.irq_events));
+  len += sprintf(buf+len, "s2mm_completed %llu\n", this->s2mm.completed);
+  len += sprintf(buf+len, "s2mm_sleeps %llu\n", this->s2mm.sleeps);
+  len += sprintf(buf+len, "s2mm_bw_MBps %lu\n", this->s2mm.bw);
+  len += sprintf(buf+len, "s2mm_bounced %llu\n", this->s2mm.bounced);
+  len += sprintf(buf+len, "defer_unpin %u\n", this->defer_unpin);
+  len += sprintf(buf+len, "unpin_backlog %d\n",
+                 atomic_read(&this->nr_unpin));
+  len += sprintf(buf+len, "pin_cache_pages %lu\n", this->pin_pages);
+  len += sprintf(buf+len, "pin_cache_hits %llu\n", this->pin_hits);
+  len += sprintf(buf+len, "pin_cache_misses %llu\n", this->pin_misses);
+  len += sprintf(buf+len, "rxring %s\n",
+                 (this->rxring != NULL) ? "on" : "off");
+  return len;
+}
+static DEVICE_ATTR_RO(stats);
+
+static int zfifo_perf_show(zfifo_chan *ch, const char *name, char *buf){
+  zfifo_perf p;
+  int irqs;
+  int len = 0;
+  int i;
+
+  mutex_lock(&ch->lock);
+  p = ch->perf;
+  irqs = atomic_read(&ch->irq_events) - p.irq_base;
+  mutex_unlock(&ch->lock);
+
+  len += sprintf(buf+len, "%s_transfers %llu\n", name, p.transfers);
+  len += sprintf(buf+len, "%s_bytes %llu\n", name, p.bytes);
+  len += sprintf(buf+len, "%s_errors %llu\n", name, p.errors);
+  len += sprintf(buf+len, "%s_irqs %d\n", name, irqs);
+  len += sprintf(buf+len, "%s_pages_pinned %llu\n", name, p.pages);
+  len += sprintf(buf+len, "%s_sg_entries %llu\n", name, p.sg_ents);
+  len += sprintf(buf+len, "%s_descs_built %llu\n", name, p.descs);
+  // pages that did not need a descriptor of their own
+  len += sprintf(buf+len, "%s_merge_pct %llu\n", name,
+                 (p.pages > p.descs) ?
+                 100 - div64_u64(p.descs * 100, p.pages) : 0);
+  len += sprintf(buf+len, "%s_pin_ns %llu\n", name, p.pin_ns);
+  len += sprintf(buf+len, "%s_map_ns %llu\n", name, p.map_ns);
+  len += sprintf(buf+len, "%s_build_ns %llu\n", name, p.build_ns);
+  len += sprintf(buf+len, "%s_dma_ns %llu\n", name, p.dma_ns);
+  len += sprintf(buf+len, "%s_wait_ns %llu\n", name, p.wait_ns);
+  len += sprintf(buf+len, "%s_unpin_ns %llu\n", name, p.unpin_ns);
+  len += sprintf(buf+len, "%s_dropped_bytes %llu\n", name, p.dropped);
+  len += sprintf(buf+len, "%s_lat_hist_log2us", name);
+  for (i=0; i<ZFIFO_HIST_BUCKETS; i++)
+    len += sprintf(buf+len, " %llu", p.hist[i]);
+  len += sprintf(buf+len, "\n");
+  return len;
+}
+
+// Counters since the last reset; any write resets them
+static ssize_t perf_show(struct device *dev,
+                         struct device_attribute *attr, char *buf){
+  zfifo_device_data* this = dev_get_drvdata(dev);
+  int len = 0;
+
+  len += zfifo_perf_show(&this->mm2s, "mm2s", buf+len);
+  len += zfifo_perf_show(&this->s2mm, "s2mm", buf+len);
+  return len;
+}
+
+static ssize_t perf_store(struct device *dev,
+                          struct device_attribute *attr,
+                          const char *buf, size_t count){
+  zfifo_device_data* this = dev_get_drvdata(dev);
+
+  zfifo_perf_reset(&this->mm2s);
+  zfifo_perf_reset(&this->s2mm);
+  return count;
+}
+static DEVICE_ATTR_RW(perf);
+
+static struct attribute *zfifo_attrs[] = {
+  &dev_attr_irq_threshold.attr,
+  &dev_attr_irq_delay.attr,
+  &dev_attr_wait_policy.attr,
+  &dev_attr_poll_us.attr,
+  &dev_attr_rxring_slots.attr,
+  &dev_attr_rxring_slot_size.attr,
+  &dev_attr_bounce_threshold.attr,
+  &dev_attr_defer_unpin.attr,
+  &dev_attr_stats.attr,
+  &dev_attr_perf.attr,
+  NULL,
+};
+ATTRIBUTE_GROUPS(zfifo);
+
+// ----------------------------------------------------------------------
+// In-kernel benchmark (/sys/kernel/debug/zfifo/zfifoN/): loopback
+// transfers from kernel buffers through zfifo_queue(), like read/write
+// but without pinning, timing every stage of the path. Writing a buffer
+// kind to "bench" runs it, reading "bench" prints the breakdown. The
+// stream core must loop MM2S back to S2MM (examples/fifo, EMU=1).
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,11,0)
+#define zfifo_kmap   kmap_local_page
+#define zfifo_kunmap kunmap_local
+#else
+#define zfifo_kmap   kmap_atomic
+#define zfifo_kunmap kunmap_atomic
+#endif
+
+enum {
+  ZFIFO_BENCH_CONTIG,   // alloc_pages(): one physically contiguous block
+  ZFIFO_BENCH_SCATTER,  // alloc_page() each: one sg entry per page
+  ZFIFO_BENCH_CMA,      // dma_alloc_pages(): CMA, mapped by the allocator
+  ZFIFO_BENCH_KINDS
+};
+
+static const char * const zfifo_bench_kind_name[ZFIFO_BENCH_KINDS] = {
+  "contig", "scatter", "cma"
+};
+
+enum {
+  ZFIFO_BENCH_SG,       // scatterlist of the pages (instead of pinning)
+  ZFIFO_BENCH_MAP,      // dma_map_sg() without cache maintenance
+  ZFIFO_BENCH_SYNC_DEV, // cache maintenance before the DMA
+  ZFIFO_BENCH_QUEUE,    // channel lock, reap, ring reservation
+  ZFIFO_BENCH_DESC,     // descriptor chain written to coherent memory
+  ZFIFO_BENCH_DMA,      // TAILDESC to the interrupt (or poll)
+  ZFIFO_BENCH_WAKE,     // interrupt to the waiter returning
+  ZFIFO_BENCH_SYNC_CPU, // cache maintenance after the DMA
+  ZFIFO_BENCH_UNMAP,    // dma_unmap_sg(), scatterlist freed
+  ZFIFO_BENCH_STAGES
+};
+
+static const char * const zfifo_bench_stage_name[ZFIFO_BENCH_STAGES] = {
+  "sg", "map", "sync_dev", "queue", "desc", "dma", "wake", "sync_cpu",
+  "unmap"
+};
+
+// [0]: MM2S, [1]: S2MM
+static const enum dma_data_direction zfifo_bench_dirs[2] = {
+  DMA_TO_DEVICE, DMA_FROM_DEVICE
+};
+
+typedef struct {
+  int      valid;
+  int      error;       // the run stopped on it, 0: none
+  unsigned size, count;
+  unsigned done;        // transfers completed
+  unsigned nents[2];    // mapped sg entries per transfer
+  unsigned ndesc[2];    // descriptors per transfer
+  unsigned long mismatch; // verify: pages received wrong
+  u64      alloc_ns;    // buffers, once per run
+  u64      wall_ns;     // all transfers
+  u64      sum[2][ZFIFO_BENCH_STAGES];
+  u64      max[2][ZFIFO_BENCH_STAGES];
+} zfifo_bench_result;
+
+typedef struct zfifo_bench {
+  struct dentry *dir;
+  struct mutex   lock;  // one run at a time
+  u32            size;  // bytes per transfer
+  u32            count; // transfers per run
+  u32            timeout_ms; // per transfer, then it is cancelled
+  bool           verify; // compare what comes back
+  zfifo_bench_result res[ZFIFO_BENCH_KINDS];
+} zfifo_bench;
+
+typedef struct {
+  int           kind;
+  enum dma_data_direction dir;
+  size_t        size;   // whole pages
+  unsigned      npages;
+  struct page **pages;
+  struct page  *head;   // contig, cma: first page
+  dma_addr_t    dma;    // cma: mapping by dma_alloc_pages()
+} zfifo_bench_buf;
+
+static struct dentry *zfifo_debugfs_root = NULL;
+
+// Partially allocated buffers are released by zfifo_bench_buf_free()
+static int zfifo_bench_buf_alloc(zfifo_device_data* this, zfifo_bench_buf *b,
+                                 int kind, unsigned long len,
+                                 enum dma_data_direction dir){
+  unsigned i;
+
+  b->kind   = kind;
+  b->dir    = dir;
+  b->npages = DIV_ROUND_UP(len, PAGE_SIZE);
+  b->size   = (size_t)b->npages << PAGE_SHIFT;
+  if ((b->pages = kvcalloc(b->npages, sizeof(*b->pages), GFP_KERNEL)) == NULL)
+    return -ENOMEM;
+
+  switch (kind){
+  case ZFIFO_BENCH_CONTIG:
+    b->head = alloc_pages(GFP_KERNEL | __GFP_NOWARN, get_order(b->size));
+    if (b->head == NULL) return -ENOMEM;
+    break;
+  case ZFIFO_BENCH_SCATTER:
+    for (i=0; i<b->npages; i++)
+      if ((b->pages[i] = alloc_page(GFP_KERNEL)) == NULL) return -ENOMEM;
+    return 0;
+  case ZFIFO_BENCH_CMA:
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,10,0)
+    b->head = dma_alloc_pages(this->dma_dev, b->size, &b->dma, dir,
+                              GFP_KERNEL | __GFP_NOWARN);
+    if (b->head == NULL) return -ENOMEM;
+    break;
+#else
+    return -EOPNOTSUPP;
+#endif
+  }
+  for (i=0; i<b->npages; i++)
+    b->pages[i] = nth_page(b->head, i);
+  return 0;
+}
+
+static void zfifo_bench_buf_free(zfifo_device_data* this, zfifo_bench_buf *b){
+  unsigned i;
+
+  if (b->pages == NULL) return;
+  switch (b->kind){
+  case ZFIFO_BENCH_CONTIG:
+    if (b->head) __free_pages(b->head, get_order(b->size));
+    break;
+  case ZFIFO_BENCH_SCATTER:
+    for (i=0; i<b->npages; i++)
+      if (b->pages[i]) __free_page(b->pages[i]);
+    break;
+  case ZFIFO_BENCH_CMA:
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,10,0)
+    if (b->head)
+      dma_free_pages(this->dma_dev, b->size, b->head, b->dma, b->dir);
 #endif
-    finish_wait(&this->mm2s_waitq, &wait);
+    break;
   }
+  kvfree(b->pages);
+  b->pages = NULL;
+}
 
-  // wait 
-  while( ~this->dma_regs[MM2S_DMASR] & DMASR_IOC_Irq ){};
-  this->dma_regs[MM2S_DMASR] = (DMASR_IOC_Irq | DMASR_ERR_Irq);
+// Fill the first len bytes with a pattern (rx == NULL), or compare rx
+// with tx: returns # of pages that differ
+static unsigned long zfifo_bench_data(zfifo_bench_buf *tx,
+                                      zfifo_bench_buf *rx,
+                                      unsigned long len){
+  unsigned long off, bad = 0;
+
+  for (off=0; off<len; off+=PAGE_SIZE){
+    unsigned long n = min_t(unsigned long, len - off, PAGE_SIZE);
+    u32 *a = zfifo_kmap(tx->pages[off >> PAGE_SHIFT]);
+    unsigned i;
+
+    if (rx == NULL){
+      for (i=0; i<n/4; i++) a[i] = (u32)(off/4 + i) ^ 0x5a5a0000;
+    } else {
+      u32 *b = zfifo_kmap(rx->pages[off >> PAGE_SHIFT]);
+      if (memcmp(a, b, n)) bad++;
+      memset(b, 0, n); // stale data must not pass next time
+      zfifo_kunmap(b);
+    }
+    zfifo_kunmap(a);
+  }
+  return bad;
+}
 
-  // stop 
-  this->dma_regs[MM2S_DMACR] = 0;
-  
-  free_sg_buf(sg_map);
-  return 0;
-} 
+// Scatterlist for len bytes of a buffer, as alloc_sg_buf() makes one of
+// pinned pages. Scatter keeps one entry per page even if they touch.
+static sg_mapping *zfifo_bench_sg(zfifo_device_data* this,
+                                  zfifo_bench_buf *b, unsigned long len){
+  sg_mapping *sg_map;
+  unsigned npages = DIV_ROUND_UP(len, PAGE_SIZE);
+  int rc;
 
-static void zfifo_dmac_reset(zfifo_device_data* this){
-  this->dma_regs[MM2S_DMACR] = DMACR_RESET;
-  while (this->dma_regs[MM2S_DMACR] & DMACR_RESET);
+  if ((sg_map = kzalloc(sizeof(*sg_map), GFP_KERNEL)) == NULL)
+    return NULL;
 
-  this->dma_regs[S2MM_DMACR] = DMACR_RESET;
-  while (this->dma_regs[S2MM_DMACR] & DMACR_RESET);
+  if (b->kind == ZFIFO_BENCH_SCATTER){
+    struct scatterlist *sg;
+    int i;
 
-  //   printk("Done AXI DMA Reset\n");
+    rc = sg_alloc_table(&sg_map->sgt, npages, GFP_KERNEL);
+    if (rc == 0)
+      for_each_sg(sg_map->sgt.sgl, sg, npages, i)
+        sg_set_page(sg, b->pages[i],
+                    min_t(unsigned long, len - i*PAGE_SIZE, PAGE_SIZE), 0);
+  } else {
+    rc = sg_alloc_table_from_pages(&sg_map->sgt, b->pages, npages, 0, len,
+                                   GFP_KERNEL);
+  }
+  if (rc){
+    kfree(sg_map);
+    return NULL;
+  }
+  sg_map->dev = this;
+  sg_map->dir = b->dir;
+  sg_map->sgl = sg_map->sgt.sgl;
+  sg_map->nsg = sg_map->sgt.orig_nents;
+  sg_map->len = len;
+  return sg_map;
 }
 
-// ----------------------------------------------------------------------
-// Device file operations
-
-static int zfifo_open(struct inode *inode, struct file *file){
-  zfifo_device_data* this;
-  int status = 0;
-
-  this = container_of(inode->i_cdev, zfifo_device_data, cdev);
-  file->private_data = this;
-  this->is_open = 1;
-#ifdef DEBUG_ZFIFO
-  dev_dbg(this->sys_dev, "open: DMA regs at %pa\n", &this->dma_regs_phys);
-#endif
-  
-  return status;
+static int zfifo_bench_map(zfifo_device_data* this, zfifo_bench_buf *b,
+                           sg_mapping *sg_map){
+  if (b->kind == ZFIFO_BENCH_CMA){
+    // mapped by the allocator already, as one segment
+    sg_dma_address(sg_map->sgl) = b->dma;
+    sg_dma_len(sg_map->sgl)     = sg_map->len;
+    sg_map->nents = 1;
+  } else {
+    sg_map->nents = dma_map_sg_attrs(this->dma_dev, sg_map->sgl, sg_map->nsg,
+                                     sg_map->dir, DMA_ATTR_SKIP_CPU_SYNC);
+    if (sg_map->nents == 0) return -EIO;
+  }
+  sg_map->max_desc = sg_desc_bound(this, sg_map);
+  return 0;
 }
 
-static int zfifo_release(struct inode *inode, struct file *file){
-  zfifo_device_data* this = file->private_data;
+static void zfifo_bench_unmap(zfifo_device_data* this, zfifo_bench_buf *b,
+                              sg_mapping *sg_map){
+  if (b->kind != ZFIFO_BENCH_CMA && sg_map->nents != 0)
+    dma_unmap_sg_attrs(this->dma_dev, sg_map->sgl, sg_map->nsg, sg_map->dir,
+                       DMA_ATTR_SKIP_CPU_SYNC);
+  sg_free_table(&sg_map->sgt);
+  kfree(sg_map);
+}
 
-#ifdef DEBUG_ZFIFO
-  dev_dbg(this->sys_dev, "close: DMA regs at %pa\n", &this->dma_regs_phys);
-#endif
-  this->is_open = 0;
+// Free a benchmark request. One still in flight is cancelled with err
+// after halting its channel, which has nothing else queued since the
+// benchmark runs only on an idle device. Returns the request's result.
+static long zfifo_bench_retire(zfifo_device_data* this, zfifo_req *req,
+                               enum dma_data_direction dir, long err){
+  zfifo_chan *ch = zfifo_chan_of(this, dir);
+  long result;
+
+  mutex_lock(&ch->lock);
+  zfifo_chan_reap(this, ch);
+  if (!req->done){
+    zfifo_chan_halt(ch);
+    zfifo_req_complete(this, ch, req, err);
+    if (list_empty(&ch->active) && !ch->ring)
+      ch->head = 0;
+  }
+  result = req->result;
+  zfifo_req_free(ch, req);
+  mutex_unlock(&ch->lock);
+  return result;
+}
 
-  return 0;
+// zfifo_req_wait() with a deadline, for a core that never answers.
+// The request is freed in any case.
+static long zfifo_bench_wait(zfifo_device_data* this, zfifo_req *req,
+                             enum dma_data_direction dir,
+                             unsigned long deadline){
+  zfifo_chan *ch = zfifo_chan_of(this, dir);
+  zfifo_wait_ctx wc;
+
+  zfifo_wait_begin(this, ch, req->len, &wc);
+  for(;;){
+    int events = atomic_read(&ch->irq_events);
+    int done;
+
+    mutex_lock(&ch->lock);
+    zfifo_chan_reap(this, ch);
+    done = req->done;
+    mutex_unlock(&ch->lock);
+
+    if (done)
+      return zfifo_bench_retire(this, req, dir, 0);
+    if (time_after(jiffies, deadline))
+      return zfifo_bench_retire(this, req, dir, -ETIMEDOUT);
+    if (fatal_signal_pending(current))
+      return zfifo_bench_retire(this, req, dir, -EINTR);
+
+    if (wc.poll_until == KTIME_MAX || ktime_before(ktime_get(), wc.poll_until))
+      cpu_relax();
+    else if (ch->irq == 0)
+      usleep_range(wc.sleep_us, wc.sleep_us * 2);
+    else
+      wait_event_killable_timeout(this->waitq,
+                                  atomic_read(&ch->irq_events) != events,
+                                  max_t(long, deadline - jiffies, 1));
+  }
 }
 
-static long zfifo_ioctl(struct file *file, unsigned int ioctlnum,
-                       unsigned long param){
+// One loopback transfer of len bytes: S2MM queued first, then MM2S.
+// Stage times are added to res only when both directions succeed.
+static int zfifo_bench_xfer(zfifo_device_data* this, struct file *file,
+                            zfifo_bench_buf *buf, unsigned long len,
+                            int verify, unsigned timeout_ms,
+                            zfifo_bench_result *res){
+  sg_mapping *sg_map[2] = { NULL, NULL };
+  zfifo_req  *req[2];
+  zfifo_io_ex ex[2];
+  s64 t[2][ZFIFO_BENCH_STAGES];
+  s64 build_ns[2];
+  unsigned long deadline;
+  ktime_t t0;
+  int d, s, rc = 0;
+
+  memset(t, 0, sizeof(t));
+  memset(ex, 0, sizeof(ex));
+
+  for (d=0; d<2; d++){
+    t0 = ktime_get();
+    sg_map[d] = zfifo_bench_sg(this, &buf[d], len);
+    t[d][ZFIFO_BENCH_SG] = ktime_to_ns(ktime_sub(ktime_get(), t0));
+    if (sg_map[d] == NULL){
+      rc = -ENOMEM;
+      goto unmap;
+    }
 
-  zfifo_device_data* this = file->private_data;
-  zfifo_io zio;
+    t0 = ktime_get();
+    rc = zfifo_bench_map(this, &buf[d], sg_map[d]);
+    t[d][ZFIFO_BENCH_MAP] = ktime_to_ns(ktime_sub(ktime_get(), t0));
+    if (rc) goto unmap;
 
-  // Get user parameters and check them
-  if (ioctlnum != IOCTL_RESET){
-    int rc;
-    if ((rc = copy_from_user(&zio, (void *)param, sizeof(zfifo_io)))) {
-      printk(KERN_ERR "zfifo: cannot read ioctl user parameter.\n");
-      return rc;
+    t0 = ktime_get();
+    sync_sg_buf(this, sg_map[d], len, 1);
+    t[d][ZFIFO_BENCH_SYNC_DEV] = ktime_to_ns(ktime_sub(ktime_get(), t0));
+  }
+
+  req[0] = req[1] = NULL;
+  for (d=1; d>=0; d--){
+    if ((req[d] = kzalloc(sizeof(*req[d]), GFP_KERNEL)) == NULL){
+      rc = -ENOMEM;
+      goto cancel;
     }
+    req[d]->owner    = file;
+    req[d]->len      = len;
+    req[d]->sg_map   = sg_map[d];
+    req[d]->keep_map = 1;
+    req[d]->ex       = &ex[d];
+    if ((rc = zfifo_queue(this, req[d], zfifo_bench_dirs[d], 0)) != 0){
+      req[d] = NULL; // discarded
+      goto cancel;
+    }
+    build_ns[d] = req[d]->build_ns; // not freed before it is waited for
+  }
 
-    // Check parameters
-    if ((dma_addr_t)zio.data & 0x3){
-      printk(KERN_ERR "zfifo: user buffer must be 32bit word aligned.\n");
-      return -EINVAL;
+  deadline = jiffies + msecs_to_jiffies(timeout_ms);
+  for (d=0; d<2; d++){
+    long result = zfifo_bench_wait(this, req[d], zfifo_bench_dirs[d],
+                                   deadline);
+
+    req[d] = NULL;
+    t[d][ZFIFO_BENCH_WAKE] = ktime_to_ns(ktime_get()) - ex[d].t_irq;
+    if (result < 0){
+      rc = (int)result;
+      goto cancel;
+    }
+    if (d == 1 && result != (long)len){
+      rc = -EIO; // short packet
+      goto unmap;
     }
+  }
 
-    if (zio.len & 0x3){
-      printk(KERN_ERR "zfifo: transfer length must be 4n bytes.\n");
-      return -EINVAL;
+  for (d=0; d<2; d++){
+    t[d][ZFIFO_BENCH_DESC]  = build_ns[d];
+    t[d][ZFIFO_BENCH_QUEUE] = ex[d].t_start - ex[d].t_submit - build_ns[d];
+    t[d][ZFIFO_BENCH_DMA]   = ex[d].t_irq - ex[d].t_start;
+
+    t0 = ktime_get();
+    sync_sg_buf(this, sg_map[d], len, 0);
+    t[d][ZFIFO_BENCH_SYNC_CPU] = ktime_to_ns(ktime_sub(ktime_get(), t0));
+    res->nents[d] = sg_map[d]->nents;
+    res->ndesc[d] = sg_map[d]->num_sg;
+  }
+  if (verify)
+    res->mismatch += zfifo_bench_data(&buf[0], &buf[1], len);
+
+  for (d=0; d<2; d++){
+    t0 = ktime_get();
+    zfifo_bench_unmap(this, &buf[d], sg_map[d]);
+    t[d][ZFIFO_BENCH_UNMAP] = ktime_to_ns(ktime_sub(ktime_get(), t0));
+
+    for (s=0; s<ZFIFO_BENCH_STAGES; s++){
+      u64 ns = (t[d][s] > 0) ? t[d][s] : 0;
+      res->sum[d][s] += ns;
+      res->max[d][s]  = max(res->max[d][s], ns);
     }
+  }
+  return 0;
 
-    // no len=0 transger
-    if (zio.len == 0) return 0;
+ cancel:
+  // the buffers go away: take back what is still queued
+  for (d=0; d<2; d++)
+    if (req[d] != NULL)
+      zfifo_bench_retire(this, req[d], zfifo_bench_dirs[d], -ECANCELED);
+ unmap:
+  for (d=0; d<2; d++)
+    if (sg_map[d] != NULL)
+      zfifo_bench_unmap(this, &buf[d], sg_map[d]);
+  return rc;
+}
+
+// Take the device for a run: nobody has it open (and no open() succeeds
+// until the run ends), nothing is in flight, no receive ring or bypass
+static int zfifo_bench_claim(zfifo_device_data* this){
+  int busy;
+
+  if (atomic_cmpxchg(&this->nr_open, 0, -1) != 0)
+    return -EBUSY;
+  mutex_lock(&this->mm2s.lock);
+  mutex_lock(&this->s2mm.lock);
+  busy = this->rxring != NULL || this->bypass != NULL ||
+         !list_empty(&this->mm2s.active) || !list_empty(&this->s2mm.active);
+  mutex_unlock(&this->s2mm.lock);
+  mutex_unlock(&this->mm2s.lock);
+  if (busy){
+    atomic_set(&this->nr_open, 0);
+    return -EBUSY;
   }
+  return 0;
+}
 
-  // IOCTLs
-  switch(ioctlnum){
-  case IOCTL_SEND:
-    zfifo_send(this, zio.data, zio.len);
-    break;
-      
-  case IOCTL_RECV:
-    zfifo_recv(this, zio.data, zio.len);
-    break;
+static int zfifo_bench_run(zfifo_device_data* this, struct file *file,
+                           int kind){
+  zfifo_bench *bench = this->bench;
+  zfifo_bench_result *res = &bench->res[kind];
+  zfifo_bench_buf buf[2];
+  unsigned long len = bench->size;
+  unsigned count = bench->count;
+  unsigned timeout_ms = bench->timeout_ms;
+  int verify = bench->verify;
+  ktime_t t0;
+  unsigned i;
+  int d, rc = 0;
+
+  memset(res, 0, sizeof(*res));
+  memset(buf, 0, sizeof(buf));
+  res->size  = len;
+  res->count = count;
+  res->valid = 1;
+  if (len == 0 || (len & 0x3) || count == 0 || timeout_ms == 0)
+    return res->error = -EINVAL;
+  if ((rc = zfifo_bench_claim(this)) != 0)
+    return res->error = rc;
+
+  t0 = ktime_get();
+  for (d=0; d<2; d++)
+    if ((rc = zfifo_bench_buf_alloc(this, &buf[d], kind, len,
+                                    zfifo_bench_dirs[d])) != 0)
+      goto out;
+  res->alloc_ns = ktime_to_ns(ktime_sub(ktime_get(), t0));
+  zfifo_bench_data(&buf[0], NULL, len);
+
+  t0 = ktime_get();
+  for (i=0; i<count; i++){
+    if ((rc = zfifo_bench_xfer(this, file, buf, len, verify, timeout_ms,
+                               res)) != 0)
+      break;
+    res->done++;
+    cond_resched();
+  }
+  res->wall_ns = ktime_to_ns(ktime_sub(ktime_get(), t0));
+
+ out:
+  for (d=0; d<2; d++)
+    zfifo_bench_buf_free(this, &buf[d]);
+  atomic_set(&this->nr_open, 0); // open() allowed again
+  res->error = rc;
+  return rc;
+}
 
-  case IOCTL_RESET:
-    dev_dbg(this->sys_dev, "Reset!!\n");
-    
-    break;
-    
-  default:
-    return -ENOTTY;
+static void zfifo_bench_print(struct seq_file *m, int kind,
+                              zfifo_bench_result *res){
+  u64 total[2] = { 0, 0 };
+  u64 bytes = (u64)res->size * res->done;
+  int d, s;
+
+  seq_printf(m, "%s: %u bytes x %u/%u", zfifo_bench_kind_name[kind],
+             res->size, res->done, res->count);
+  if (res->error)
+    seq_printf(m, ", error %d", res->error);
+  if (res->mismatch)
+    seq_printf(m, ", %lu pages mismatched", res->mismatch);
+  seq_puts(m, "\n");
+  if (res->done == 0) return;
+
+  for (d=0; d<2; d++)
+    for (s=0; s<ZFIFO_BENCH_STAGES; s++)
+      total[d] += res->sum[d][s];
+
+  seq_printf(m, "  alloc %llu us, mm2s %u sg / %u desc, s2mm %u sg / %u desc\n",
+             div_u64(res->alloc_ns, 1000), res->nents[0], res->ndesc[0],
+             res->nents[1], res->ndesc[1]);
+  seq_printf(m, "  %-9s %10s %10s %4s %10s %10s %4s\n", "stage(ns)",
+             "mm2s avg", "max", "%", "s2mm avg", "max", "%");
+  for (s=0; s<ZFIFO_BENCH_STAGES; s++){
+    seq_printf(m, "  %-9s", zfifo_bench_stage_name[s]);
+    for (d=0; d<2; d++)
+      seq_printf(m, " %10llu %10llu %4llu",
+                 div_u64(res->sum[d][s], res->done), res->max[d][s],
+                 total[d] ? div64_u64(res->sum[d][s] * 100, total[d]) : 0);
+    seq_puts(m, "\n");
+  }
+  seq_printf(m, "  %-9s %10llu %21s %10llu\n", "total",
+             div_u64(total[0], res->done), "", div_u64(total[1], res->done));
+  // bytes/us = MB/s
+  seq_printf(m, "  loopback %llu MB/s, mm2s dma %llu MB/s, "
+             "mm2s driver path %llu MB/s\n",
+             res->wall_ns ? div64_u64(bytes * 1000, res->wall_ns) : 0,
+             res->sum[0][ZFIFO_BENCH_DMA] ?
+             div64_u64(bytes * 1000, res->sum[0][ZFIFO_BENCH_DMA]) : 0,
+             total[0] ? div64_u64(bytes * 1000, total[0]) : 0);
+}
+
+static int zfifo_bench_show(struct seq_file *m, void *v){
+  zfifo_device_data* this = m->private;
+  zfifo_bench *bench = this->bench;
+  int kind, n = 0;
+
+  mutex_lock(&bench->lock);
+  for (kind=0; kind<ZFIFO_BENCH_KINDS; kind++){
+    if (!bench->res[kind].valid) continue;
+    zfifo_bench_print(m, kind, &bench->res[kind]);
+    n++;
   }
+  mutex_unlock(&bench->lock);
+  if (n == 0)
+    seq_puts(m, "no results: write contig, scatter, cma or all\n");
   return 0;
 }
 
-static const struct file_operations zfifo_file_ops =
-  {
-   .owner   = THIS_MODULE,
-   .open    = zfifo_open,
-   .release = zfifo_release,
-   .unlocked_ioctl = zfifo_ioctl
+static int zfifo_bench_open(struct inode *inode, struct file *file){
+  return single_open(file, zfifo_bench_show, inode->i_private);
+}
+
+// "contig", "scatter", "cma" or "all": run, returns when done
+static ssize_t zfifo_bench_write(struct file *file, const char __user *ubuf,
+                                 size_t count, loff_t *ppos){
+  zfifo_device_data* this = ((struct seq_file *)file->private_data)->private;
+  zfifo_bench *bench = this->bench;
+  char buf[16];
+  int kind, rc = 0;
+
+  if (count >= sizeof(buf)) return -EINVAL;
+  if (copy_from_user(buf, ubuf, count)) return -EFAULT;
+  buf[count] = '\0';
+
+  for (kind=0; kind<ZFIFO_BENCH_KINDS; kind++)
+    if (sysfs_streq(buf, zfifo_bench_kind_name[kind])) break;
+  if (kind == ZFIFO_BENCH_KINDS && !sysfs_streq(buf, "all"))
+    return -EINVAL;
+
+  if (mutex_lock_interruptible(&bench->lock))
+    return -EINTR;
+  if (kind < ZFIFO_BENCH_KINDS){
+    rc = zfifo_bench_run(this, file, kind);
+  } else {
+    for (kind=0; kind<ZFIFO_BENCH_KINDS && rc != -EINTR; kind++)
+      rc = zfifo_bench_run(this, file, kind);
+    rc = (rc == -EINTR) ? rc : 0; // the others are in the report
+  }
+  mutex_unlock(&bench->lock);
+  return rc ? rc : count;
+}
+
+static const struct file_operations zfifo_bench_fops = {
+  .owner   = THIS_MODULE,
+  .open    = zfifo_bench_open,
+  .read    = seq_read,
+  .write   = zfifo_bench_write,
+  .llseek  = seq_lseek,
+  .release = single_release,
 };
 
+static void zfifo_bench_create(zfifo_device_data* this){
+  zfifo_bench *bench;
+
+  if (IS_ERR_OR_NULL(zfifo_debugfs_root)) return;
+  if ((bench = kzalloc(sizeof(*bench), GFP_KERNEL)) == NULL) return;
+
+  mutex_init(&bench->lock);
+  bench->size  = 1 << 20;
+  bench->count = 100;
+  bench->timeout_ms = 1000;
+  bench->dir = debugfs_create_dir(dev_name(this->sys_dev), zfifo_debugfs_root);
+  debugfs_create_u32 ("size",   0644, bench->dir, &bench->size);
+  debugfs_create_u32 ("count",  0644, bench->dir, &bench->count);
+  debugfs_create_u32 ("timeout_ms", 0644, bench->dir, &bench->timeout_ms);
+  debugfs_create_bool("verify", 0644, bench->dir, &bench->verify);
+  debugfs_create_file("bench",  0600, bench->dir, this, &zfifo_bench_fops);
+  this->bench = bench;
+}
+
+// Waits for a run in progress (debugfs removal drains the handlers)
+static void zfifo_bench_destroy(zfifo_device_data* this){
+  if (this->bench == NULL) return;
+  debugfs_remove_recursive(this->bench->dir);
+  kfree(this->bench);
+  this->bench = NULL;
+}
+
 // ------------------------------------------------------------
 // Device Data Operations
 
@@ -551,6 +4349,22 @@ zfifo_device_create(const char* name, struct device* parent, int minor){
   // set device #
   this->device_number = MKDEV(MAJOR(zfifo_device_number ), minor);
 
+  idr_init(&this->reg_idr);
+  mutex_init(&this->reg_lock);
+  INIT_LIST_HEAD(&this->pins);
+  mutex_init(&this->pin_lock);
+  init_waitqueue_head(&this->waitq);
+  INIT_LIST_HEAD(&this->evfds);
+  spin_lock_init(&this->evfd_lock);
+  atomic_set(&this->nr_evfd, 0);
+  atomic_set(&this->nr_async, 0);
+  atomic_set(&this->nr_open, 0);
+  INIT_WORK(&this->reap_work, zfifo_reap_work);
+  INIT_LIST_HEAD(&this->unpin_list);
+  spin_lock_init(&this->unpin_lock);
+  atomic_set(&this->nr_unpin, 0);
+  INIT_WORK(&this->unpin_work, zfifo_unpin_work);
+
   // sysfs registration: good to get sys_dev
   if (name == NULL) {
     this->sys_dev = device_create(zfifo_sys_class,
@@ -602,6 +4416,7 @@ zfifo_device_create(const char* name, struct device* parent, int minor){
 
 static int zfifo_device_setup(zfifo_device_data* this){
   unsigned tx_offset, rx_offset;
+  unsigned slots, size;
   void *tx, *rx;
   unsigned int dma_mask_bit;
   
@@ -630,11 +4445,31 @@ static int zfifo_device_setup(zfifo_device_data* this){
   tx = this->tx_desc_base + tx_offset;
   rx = this->rx_desc_base + rx_offset;
 
-  this->tx_desc = (unsigned*)tx;
-  this->rx_desc = (unsigned*)rx;
-
-  this->tx_phys = this->tx_phys_base + tx_offset;
-  this->rx_phys = this->rx_phys_base + rx_offset;
+  this->mm2s.desc = (unsigned*)tx;
+  this->s2mm.desc = (unsigned*)rx;
+
+  this->mm2s.phys = this->tx_phys_base + tx_offset;
+  this->s2mm.phys = this->rx_phys_base + rx_offset;
+
+  this->mm2s.ndesc = (desc_size - 0x40) / 0x40;
+  this->s2mm.ndesc = (desc_size - 0x40) / 0x40;
+
+  // bounce pools for small transfers, zero-copy only if they fail. The
+  // slot size is limited by this device's descriptor length.
+  slots = min_t(unsigned, bounce_slots, BITS_PER_LONG);
+  size  = min_t(unsigned, ALIGN(bounce_size, 64), this->dmac_buf_len & ~63u);
+  if (slots != 0 && size != 0){
+    this->mm2s.bounce = dma_alloc_coherent(this->dma_dev, slots * size,
+                                           &this->mm2s.bounce_dma, GFP_KERNEL);
+    this->s2mm.bounce = dma_alloc_coherent(this->dma_dev, slots * size,
+                                           &this->s2mm.bounce_dma, GFP_KERNEL);
+    if (this->mm2s.bounce == NULL || this->s2mm.bounce == NULL)
+      dev_warn(this->sys_dev, "no bounce buffers, zero-copy only\n");
+  }
+  this->mm2s.bounce_slots = this->s2mm.bounce_slots = slots;
+  this->mm2s.bounce_size  = this->s2mm.bounce_size  = size;
+  this->bounce_threshold = min(bounce_threshold, size);
+  this->defer_unpin = (defer_unpin != 0);
   
   return 0;
 }
@@ -649,27 +4484,565 @@ static void zfifo_device_info(zfifo_device_data* this){
   dev_info(this->sys_dev, "major number   = %d\n"  , MAJOR(this->device_number));
   dev_info(this->sys_dev, "minor number   = %d\n"  , MINOR(this->device_number));
   dev_info(this->sys_dev, "DMA regs       = %pa\n", &this->dma_regs_phys);
+  dev_info(this->sys_dev, "cache mode     = %s\n",
+           this->coherent ? "coherent" : "streaming");
   dev_info(this->sys_dev, "Tx descriptors = %pa (phys %pad)",
-           &this->tx_desc, &this->tx_phys);
+           &this->mm2s.desc, &this->mm2s.phys);
   dev_info(this->sys_dev, "Rx descriptors = %pa (phys %pad)",
-           &this->rx_desc, &this->rx_phys);
+           &this->s2mm.desc, &this->s2mm.phys);
   
 }
 
+#ifdef ZFIFO_EMU
+// ----------------------------------------------------------------------
+// AXI DMA emulator (make EMU=1): a kernel thread plays the DMA core on a
+// register block in memory. MM2S streams into a FIFO that is either
+// looped back to S2MM or reduced by a vec-accum core (examples/hls).
+// Data moves by memcpy, timing follows emu_mbps and emu_latency_ns.
+
+static int        emu_devices = 1;
+module_param(     emu_devices , int, S_IRUGO);
+MODULE_PARM_DESC( emu_devices , "# of emulated devices (zfifo0-)");
+
+static int        emu_mode = 0;
+module_param(     emu_mode , int, S_IRUGO);
+MODULE_PARM_DESC( emu_mode , "emulated stream core: 0 loopback, 1 vec-accum");
+
+static int        emu_irq = 1;
+module_param(     emu_irq , int, S_IRUGO);
+MODULE_PARM_DESC( emu_irq , "simulated interrupts, 0: polling only");
+
+static unsigned   emu_fifo_size = 16384;
+module_param(     emu_fifo_size , uint, S_IRUGO);
+MODULE_PARM_DESC( emu_fifo_size , "stream FIFO between MM2S and S2MM (bytes)");
+
+static unsigned   emu_mbps = 0;
+module_param(     emu_mbps , uint, S_IRUGO);
+MODULE_PARM_DESC( emu_mbps , "emulated bandwidth per channel (MB/s), 0: unlimited");
+
+static unsigned   emu_latency_ns = 0;
+module_param(     emu_latency_ns , uint, S_IRUGO);
+MODULE_PARM_DESC( emu_latency_ns , "emulated latency per descriptor (ns)");
+
+static unsigned   emu_fault_rate = 0;
+module_param(     emu_fault_rate , uint, S_IRUGO);
+MODULE_PARM_DESC( emu_fault_rate , "fail every Nth descriptor with DMASlvErr, 0: never");
+
+static unsigned   emu_poll_us = 5;
+module_param(     emu_poll_us , uint, S_IRUGO);
+MODULE_PARM_DESC( emu_poll_us , "emulator poll interval (us), 0: busy");
+
+#define ZFIFO_EMU_NOTAIL   1u  // CURDESC/TAILDESC taken, not an address
+#define ZFIFO_EMU_PKTS     256 // TLASTs in the FIFO
+#define ZFIFO_EMU_BUDGET   16  // descriptors per channel per pass
+#define ZFIFO_EMU_MM2S_IRQ 1   // never requested: zfifo_intr() is called
+#define ZFIFO_EMU_S2MM_IRQ 2
+
+#define DMASR_SGIncld   (1u<<3)
+#define DMASR_DMAIntErr (1u<<4)
+#define DMASR_DMASlvErr (1u<<5)
+#define DMASR_DMADecErr (1u<<6)
+#define DMASR_SGIntErr  (1u<<8)
+#define DMASR_SGDecErr  (1u<<10)
+#define DESC_STS_RXSOF  (1u<<27)
+
+irqreturn_t zfifo_intr(int irq, void *dev_id);
+
+typedef struct {
+  int       run;        // RS seen, not halted
+  int       has_tail;   // tail not reached yet
+  u64       cur, tail;  // descriptor in process, the last one to process
+  unsigned  off;        // bytes of cur moved
+  int       started;    // cur is timed: ready_ns is valid
+  int       data_done;  // cur has moved all its data
+  int       rxeof;      // S2MM: cur ended a packet
+  int       sof;        // S2MM: next descriptor starts a packet
+  u64       ready_ns;   // cur completes no earlier
+  u64       busy_ns;    // the channel is busy until
+  unsigned  sr;         // DMASR but the interrupt bits
+  unsigned  ioc;        // IOC events since the last interrupt
+  u64       t_ioc;      // ns of the last IOC event, for the delay timer
+  unsigned long long ndesc; // # of descriptors fetched, fault injection
+} zfifo_emu_chan;
+
+typedef struct zfifo_emu {
+  zfifo_device_data  *dev;
+  unsigned           *regs;     // what dma_regs points to
+  struct task_struct *thread;
+  zfifo_emu_chan      ch[2];    // MM2S, S2MM
+  u8                 *fifo;     // stream FIFO, fifo_size is a power of 2
+  unsigned            fifo_size;
+  u64                 wr, rd;   // bytes into and out of the FIFO
+  u64                 eof[ZFIFO_EMU_PKTS]; // wr at each TLAST
+  unsigned            eof_wr, eof_rd;
+  u32                 acc_n, acc_sum, acc_word; // vec-accum core
+  unsigned            acc_bytes;
+} zfifo_emu;
+
+static volatile unsigned *zfifo_emu_regs(zfifo_emu *e, int c){
+  return e->regs + (c ? S2MM_DMACR : MM2S_DMACR);
+}
+
+// CURDESC/TAILDESC are taken as the low word only; the descriptor area
+// of the channel gives the rest
+static u64 zfifo_emu_addr(zfifo_emu *e, int c, unsigned low){
+  u64 base = c ? e->dev->rx_phys_base : e->dev->tx_phys_base;
+  u64 a = (base & ~0xFFFFFFFFull) | low;
+
+  return (a < base) ? a + (1ull<<32) : a;
+}
+
+// Fetch a descriptor: NULL outside the descriptor area of the channel
+static volatile unsigned *zfifo_emu_desc(zfifo_emu *e, int c, u64 addr){
+  zfifo_device_data *this = e->dev;
+  u64   base = c ? this->rx_phys_base : this->tx_phys_base;
+  void *virt = c ? this->rx_desc_base : this->tx_desc_base;
+
+  if (virt == NULL || (addr & 0x3f) || addr < base ||
+      addr - base > desc_size - 0x40)
+    return NULL;
+  return virt + (addr - base);
+}
+
+// Map up to *n bytes of a buffer at a bus address, within one page.
+// The emulated device has no IOMMU nor DMA offset: bus == physical.
+static u8 *zfifo_emu_map(u64 addr, unsigned *n){
+  unsigned long pfn = PHYS_PFN((phys_addr_t)addr);
+  unsigned off = offset_in_page(addr);
+
+  if (!pfn_valid(pfn)) return NULL;
+  *n = min_t(unsigned, *n, PAGE_SIZE - off);
+  return (u8*)zfifo_kmap(pfn_to_page(pfn)) + off;
+}
+
+static unsigned zfifo_emu_room(zfifo_emu *e){
+  return e->fifo_size - (unsigned)(e->wr - e->rd);
+}
+
+// Bytes S2MM may take before the next TLAST (*last) or the end of data
+static unsigned zfifo_emu_avail(zfifo_emu *e, int *last){
+  u64 end = e->wr;
+
+  *last = (e->eof_rd != e->eof_wr);
+  if (*last) end = e->eof[e->eof_rd % ZFIFO_EMU_PKTS];
+  return end - e->rd;
+}
+
+static void zfifo_emu_push(zfifo_emu *e, const void *p, unsigned n){
+  unsigned at = e->wr & (e->fifo_size - 1);
+  unsigned k  = min(n, e->fifo_size - at);
+
+  memcpy(e->fifo + at, p, k);
+  memcpy(e->fifo, p + k, n - k);
+  e->wr += n;
+}
+
+static void zfifo_emu_pop(zfifo_emu *e, void *p, unsigned n){
+  unsigned at = e->rd & (e->fifo_size - 1);
+  unsigned k  = min(n, e->fifo_size - at);
+
+  memcpy(p, e->fifo + at, k);
+  memcpy(p + k, e->fifo, n - k);
+  e->rd += n;
+}
+
+// vec-accum: sums the 32-bit words of a packet, a trailing partial word
+// is dropped like the HLS core would never see it
+static void zfifo_emu_accum(zfifo_emu *e, const u8 *p, unsigned n){
+  for (; n > 0 && e->acc_bytes != 0; n--, p++){
+    e->acc_word |= (u32)*p << (8 * e->acc_bytes);
+    if (++e->acc_bytes == 4){
+      e->acc_sum += e->acc_word;
+      e->acc_n++;
+      e->acc_word = e->acc_bytes = 0;
+    }
+  }
+  for (; n >= 4; n -= 4, p += 4){
+    __le32 w;
+
+    memcpy(&w, p, 4);
+    e->acc_sum += le32_to_cpu(w);
+    e->acc_n++;
+  }
+  for (; n > 0; n--, p++)
+    e->acc_word |= (u32)*p << (8 * e->acc_bytes++);
+}
+
+// MM2S: stream the buffer of d into the core. Returns 1 when all of it
+// went (and TLAST, with EOF), 0 on backpressure, or sets *err.
+static int zfifo_emu_mm2s(zfifo_emu *e, volatile unsigned *d, unsigned *err){
+  zfifo_emu_chan *ch = &e->ch[0];
+  unsigned ctrl = d[6];
+  unsigned len  = ctrl & e->dev->dmac_buf_len;
+  u64      buf  = d[2] | ((u64)d[3] << 32);
+
+  while (ch->off < len){
+    unsigned n = len - ch->off;
+    u8 *p;
+
+    if (emu_mode == 0) n = min(n, zfifo_emu_room(e));
+    if (n == 0) return 0;
+    if ((p = zfifo_emu_map(buf + ch->off, &n)) == NULL){
+      *err = DMASR_DMADecErr;
+      return 0;
+    }
+    if (emu_mode == 0)
+      zfifo_emu_push(e, p, n);
+    else
+      zfifo_emu_accum(e, p, n);
+    zfifo_kunmap(p);
+    ch->off += n;
+  }
+
+  if (!(ctrl & DESC_CTRL_EOF)) return 1;
+  if (e->eof_wr - e->eof_rd == ZFIFO_EMU_PKTS) return 0;
+  if (emu_mode != 0){
+    __le32 res[2] = { cpu_to_le32(e->acc_n), cpu_to_le32(e->acc_sum) };
+
+    if (zfifo_emu_room(e) < sizeof(res)) return 0;
+    zfifo_emu_push(e, res, sizeof(res));
+    e->acc_n = e->acc_sum = e->acc_word = e->acc_bytes = 0;
+  }
+  e->eof[e->eof_wr++ % ZFIFO_EMU_PKTS] = e->wr;
+  return 1;
+}
+
+// S2MM: fill the buffer of d from the core until it is full or TLAST
+// (ch->rxeof). Returns 1 when done, 0 waiting for data, or sets *err.
+static int zfifo_emu_s2mm(zfifo_emu *e, volatile unsigned *d, unsigned *err){
+  zfifo_emu_chan *ch = &e->ch[1];
+  unsigned len = d[6] & e->dev->dmac_buf_len;
+  u64      buf = d[2] | ((u64)d[3] << 32);
+
+  for (;;){
+    int last;
+    unsigned n = zfifo_emu_avail(e, &last);
+    u8 *p;
+
+    if (n == 0 && last){
+      e->eof_rd++;
+      ch->rxeof = 1;
+      return 1;
+    }
+    if (ch->off == len) return 1;
+    if (n == 0) return 0;
+
+    n = min(n, len - ch->off);
+    if ((p = zfifo_emu_map(buf + ch->off, &n)) == NULL){
+      *err = DMASR_DMADecErr;
+      return 0;
+    }
+    zfifo_emu_pop(e, p, n);
+    zfifo_kunmap(p);
+    ch->off += n;
+  }
+}
+
+// Raise an interrupt: DMASR shows the bits while zfifo_intr() runs.
+// Plain memory cannot clear on write, the return acknowledges them.
+static void zfifo_emu_irq(zfifo_emu *e, int c, unsigned bits){
+  zfifo_chan *zch = c ? &e->dev->s2mm : &e->dev->mm2s;
+  volatile unsigned *regs = zfifo_emu_regs(e, c);
+
+  regs[CH_DMASR] = e->ch[c].sr | bits;
+  if (zch->irq != 0)
+    zfifo_intr(zch->irq, e->dev);
+  regs[CH_DMASR] = e->ch[c].sr;
+}
+
+// Stop the channel, as on RS=0 or an error
+static void zfifo_emu_halt(zfifo_emu *e, int c){
+  zfifo_emu_chan *ch = &e->ch[c];
+
+  ch->run = ch->has_tail = 0;
+  ch->off = ch->started = ch->data_done = ch->rxeof = 0;
+  ch->sr = (ch->sr & ~DMASR_IDLE) | DMASR_HALTED;
+}
+
+// DMA errors are reported in the status word of the descriptor too; the
+// core halts and clears RS
+static void zfifo_emu_error(zfifo_emu *e, int c, volatile unsigned *d,
+                            unsigned err, unsigned cr){
+  zfifo_emu_chan *ch = &e->ch[c];
+  volatile unsigned *regs = zfifo_emu_regs(e, c);
+
+  if (d != NULL && (err & (DMASR_DMAIntErr|DMASR_DMASlvErr|DMASR_DMADecErr)))
+    d[7] = ((err & DMASR_ERR_MASK) >> 4) << 28 | (ch->off & DESC_LEN_MASK);
+  zfifo_emu_halt(e, c);
+  ch->sr |= err;
+  regs[CH_DMACR] = cr & ~DMACR_RS;
+  if (cr & DMACR_Err_Irq)
+    zfifo_emu_irq(e, c, DMASR_ERR_Irq);
+}
+
+// One completed descriptor counts as an IOC event toward IRQThreshold
+static void zfifo_emu_ioc(zfifo_emu *e, int c, unsigned cr, u64 now){
+  zfifo_emu_chan *ch = &e->ch[c];
+  unsigned thr = (cr >> 16) & 0xFF;
+
+  if (!(cr & DMACR_IOC_Irq)) return;
+  ch->t_ioc = now;
+  if (++ch->ioc >= max(thr, 1u)){
+    ch->ioc = 0;
+    zfifo_emu_irq(e, c, DMASR_IOC_Irq);
+  }
+}
+
+// Run channel c for up to ZFIFO_EMU_BUDGET descriptors. Returns nonzero
+// on progress.
+static int zfifo_emu_chan_step(zfifo_emu *e, int c){
+  zfifo_emu_chan *ch = &e->ch[c];
+  volatile unsigned *regs = zfifo_emu_regs(e, c);
+  unsigned cr = regs[CH_DMACR];
+  unsigned tail, cur, budget = ZFIFO_EMU_BUDGET;
+  int progress = 0;
+  u64 now = ktime_get_ns();
+
+  if (!(cr & DMACR_RS)){
+    if (ch->run){
+      zfifo_emu_halt(e, c);
+      progress = 1;
+    }
+    regs[CH_DMASR] = ch->sr;
+    return progress;
+  }
+
+  if (ch->sr & DMASR_ERR_MASK){
+    // as the real core: halted with the errors until DMACR.RESET,
+    // RS=1 and TAILDESC are ignored
+    regs[CH_DMASR] = ch->sr;
+    return progress;
+  }
+
+  // Register writes are seen by taking the value out. The driver writes
+  // CURDESC (only to a stopped channel), DMACR, TAILDESC in this order,
+  // so taking them the other way round never splits a start.
+  tail = xchg(&e->regs[(c ? S2MM_DMACR : MM2S_DMACR) + CH_TAILDESC],
+              ZFIFO_EMU_NOTAIL);
+  cur  = xchg(&e->regs[(c ? S2MM_DMACR : MM2S_DMACR) + CH_CURDESC],
+              ZFIFO_EMU_NOTAIL);
+  if (!ch->run || cur != ZFIFO_EMU_NOTAIL){
+    // a stop and restart may come faster than the polling
+    zfifo_emu_halt(e, c);
+    ch->run = 1;
+    if (cur != ZFIFO_EMU_NOTAIL)
+      ch->cur = zfifo_emu_addr(e, c, cur);
+    ch->sr &= ~DMASR_HALTED;
+    ch->ioc = 0;
+    progress = 1;
+  }
+  if (tail != ZFIFO_EMU_NOTAIL){
+    ch->tail     = zfifo_emu_addr(e, c, tail);
+    ch->has_tail = 1;
+    ch->sr      &= ~DMASR_IDLE;
+  }
+
+  while (ch->run && ch->has_tail && budget-- > 0){
+    volatile unsigned *d = zfifo_emu_desc(e, c, ch->cur);
+    unsigned err = 0, len, sts;
+    u64 done;
+
+    if (d == NULL){
+      zfifo_emu_error(e, c, NULL, DMASR_SGDecErr, cr);
+      return 1;
+    }
+    if (!ch->started){
+      if (d[7] & DESC_STS_CMPLT){ // fetched a completed descriptor
+        zfifo_emu_error(e, c, NULL, DMASR_SGIntErr, cr);
+        return 1;
+      }
+      len = d[6] & e->dev->dmac_buf_len;
+      if (len == 0)
+        err = DMASR_DMAIntErr;
+      else if (emu_fault_rate != 0 && ++ch->ndesc % emu_fault_rate == 0)
+        err = DMASR_DMASlvErr;
+      if (err){
+        zfifo_emu_error(e, c, d, err, cr);
+        return 1;
+      }
+      ch->ready_ns = max(now, ch->busy_ns) + emu_latency_ns +
+        (emu_mbps ? div_u64((u64)len * 1000, emu_mbps) : 0);
+      ch->busy_ns  = ch->ready_ns;
+      ch->started  = 1;
+    }
+    if (!ch->data_done){
+      unsigned off = ch->off;
+      int r = c ? zfifo_emu_s2mm(e, d, &err) : zfifo_emu_mm2s(e, d, &err);
+
+      if (err){
+        zfifo_emu_error(e, c, d, err, cr);
+        return 1;
+      }
+      progress |= (ch->off != off || r);
+      if (!r) break;
+      ch->data_done = 1;
+    }
+    if (now < ch->ready_ns) break;
+
+    sts = DESC_STS_CMPLT | (ch->off & DESC_LEN_MASK);
+    if (c){
+      if (ch->sof)   sts |= DESC_STS_RXSOF;
+      if (ch->rxeof) sts |= DESC_STS_RXEOF;
+      ch->sof = ch->rxeof;
+    }
+    wmb(); // data before the status
+    d[7] = sts;
+
+    done    = ch->cur;
+    ch->cur = d[0] | ((u64)d[1] << 32);
+    ch->off = ch->started = ch->data_done = ch->rxeof = 0;
+    if (done == ch->tail){
+      ch->has_tail = 0;
+      ch->sr |= DMASR_IDLE;
+    }
+    progress = 1;
+    regs[CH_DMASR] = ch->sr;
+    zfifo_emu_ioc(e, c, cr, now);
+  }
+
+  // delay timer: 125 SG clocks (100MHz) per IRQDelay unit since the
+  // last IOC event
+  if ((cr & DMACR_Dly_Irq) && ch->ioc != 0 &&
+      now - ch->t_ioc >= 1250ull * ((cr >> 24) & 0xFF)){
+    ch->ioc = 0;
+    zfifo_emu_irq(e, c, DMASR_Dly_Irq);
+  }
+  regs[CH_DMASR] = ch->sr;
+  return progress;
+}
+
+// DMACR.RESET on either channel resets the whole core
+static void zfifo_emu_reset(zfifo_emu *e){
+  int c;
+
+  e->wr = e->rd = 0;
+  e->eof_wr = e->eof_rd = 0;
+  e->acc_n = e->acc_sum = e->acc_word = e->acc_bytes = 0;
+  for (c=0; c<2; c++){
+    volatile unsigned *regs = zfifo_emu_regs(e, c);
+
+    memset(&e->ch[c], 0, sizeof(e->ch[c]));
+    e->ch[c].sr  = DMASR_HALTED | DMASR_SGIncld | DMACR_IRQThreshold(1);
+    e->ch[c].sof = 1;
+    regs[CH_CURDESC  ] = ZFIFO_EMU_NOTAIL;
+    regs[CH_CURDESC_H] = 0;
+    regs[CH_TAILDESC ] = ZFIFO_EMU_NOTAIL;
+    regs[CH_DMASR    ] = e->ch[c].sr; // 0x10009 as after a real reset
+  }
+  wmb();
+  e->regs[MM2S_DMACR] = DMACR_IRQThreshold(1);
+  e->regs[S2MM_DMACR] = DMACR_IRQThreshold(1);
+}
+
+static int zfifo_emu_thread(void *data){
+  zfifo_emu *e = data;
+  unsigned long idle = jiffies;
+
+  while (!kthread_should_stop()){
+    int progress = 0;
+
+    if ((e->regs[MM2S_DMACR] | e->regs[S2MM_DMACR]) & DMACR_RESET){
+      zfifo_emu_reset(e);
+      progress = 1;
+    }
+    progress |= zfifo_emu_chan_step(e, 0);
+    progress |= zfifo_emu_chan_step(e, 1);
+
+    if (progress)
+      idle = jiffies;
+    if (progress || emu_poll_us == 0)
+      cond_resched();
+    else if (time_after(jiffies, idle + HZ/10)) // idle for 100ms, still
+      usleep_range(250, 500);                   // within halt timeouts
+    else
+      usleep_range(emu_poll_us, emu_poll_us * 2);
+  }
+  return 0;
+}
+
+static int zfifo_emu_create(zfifo_device_data* this){
+  zfifo_emu *e;
+  int retval = -ENOMEM;
+
+  if ((e = kzalloc(sizeof(*e), GFP_KERNEL)) == NULL)
+    return -ENOMEM;
+  e->dev       = this;
+  e->fifo_size = roundup_pow_of_two(max(emu_fifo_size, 64u));
+  e->regs      = kzalloc(dma_reg_size, GFP_KERNEL);
+  e->fifo      = vmalloc(e->fifo_size);
+  if (e->regs == NULL || e->fifo == NULL)
+    goto failed;
+  zfifo_emu_reset(e);
+
+  e->thread = kthread_run(zfifo_emu_thread, e, "zfifo-emu%d",
+                          MINOR(this->device_number));
+  if (IS_ERR(e->thread)){
+    retval = PTR_ERR(e->thread);
+    goto failed;
+  }
+  this->emu      = e;
+  this->dma_regs = (volatile unsigned __iomem *)e->regs;
+  return 0;
+
+ failed:
+  vfree(e->fifo);
+  kfree(e->regs);
+  kfree(e);
+  return retval;
+}
+
+static void zfifo_emu_destroy(zfifo_device_data* this){
+  zfifo_emu *e = this->emu;
+
+  if (e == NULL) return;
+  kthread_stop(e->thread);
+  vfree(e->fifo);
+  kfree(e->regs);
+  kfree(e);
+  this->emu      = NULL;
+  this->dma_regs = NULL;
+}
+#endif // ZFIFO_EMU
+
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - 
 
 static int zfifo_device_destroy(zfifo_device_data* this){
   if (!this)
     return -ENODEV;
 
+  zfifo_bench_destroy(this);
+
+  if (this->dma_regs != NULL){
+    cancel_work_sync(&this->reap_work);
+    zfifo_dmac_reset(this);
+    zfifo_chan_flush(this, &this->mm2s);
+    zfifo_chan_flush(this, &this->s2mm);
+    flush_work(&this->unpin_work);
+  }
+
+#ifdef ZFIFO_EMU
+  zfifo_emu_destroy(this);
+#else
   iounmap((void*)this->dma_regs);
   release_mem_region((resource_size_t)this->dma_regs_phys, dma_reg_size);
+#endif
   
+  if (this->mm2s.bounce != NULL)
+    dma_free_coherent(this->dma_dev,
+                      this->mm2s.bounce_slots * this->mm2s.bounce_size,
+                      this->mm2s.bounce, this->mm2s.bounce_dma);
+  if (this->s2mm.bounce != NULL)
+    dma_free_coherent(this->dma_dev,
+                      this->s2mm.bounce_slots * this->s2mm.bounce_size,
+                      this->s2mm.bounce, this->s2mm.bounce_dma);
+
   dma_free_coherent(this->dma_dev, desc_size,
                     this->tx_desc_base, this->tx_phys_base);
   dma_free_coherent(this->dma_dev, desc_size,
                     this->rx_desc_base, this->rx_phys_base);
 
+  idr_destroy(&this->reg_idr);
+
   cdev_del(&this->cdev);
   device_destroy(zfifo_sys_class, this->device_number);
   ida_simple_remove(&zfifo_device_ida, MINOR(this->device_number));
@@ -687,6 +5060,8 @@ struct zfifo_static_device {
   struct platform_device* pdev;
   dma_addr_t             dmac;  // for 32bit ARM
   unsigned  mm2s_irq, s2mm_irq;
+  unsigned  len_bits;           // sg length width, 0: default
+  int       coherent;           // I/O coherent port
 };
 
 struct zfifo_static_device zfifo_static_device_list[STATIC_DEVICE_NUM] = {};
@@ -695,10 +5070,17 @@ struct zfifo_static_device zfifo_static_device_list[STATIC_DEVICE_NUM] = {};
 // Create & remove device
 
 static void zfifo_static_device_create(int id, dma_addr_t dmac,
-                                       unsigned mm2s_irq, unsigned s2mm_irq){
+                                       unsigned mm2s_irq, unsigned s2mm_irq,
+                                       unsigned len_bits, int coherent){
   struct platform_device* pdev;
   int                     retval = 0;
 
+#ifdef ZFIFO_EMU
+  // nothing to point zfifoN= at: the first emu_devices always exist
+  if (dmac == 0 && id < emu_devices)
+    dmac = ~(dma_addr_t)0;
+#endif
+
   printk("create %d regs@%pa mm2s IRQ %u s2mm IRQ %u\n",
          id, &dmac, mm2s_irq, s2mm_irq);
     
@@ -732,6 +5114,8 @@ static void zfifo_static_device_create(int id, dma_addr_t dmac,
   zfifo_static_device_list[id].dmac = dmac;
   zfifo_static_device_list[id].mm2s_irq = mm2s_irq;
   zfifo_static_device_list[id].s2mm_irq = s2mm_irq;
+  zfifo_static_device_list[id].len_bits = len_bits;
+  zfifo_static_device_list[id].coherent = coherent;
   return;
 
  failed:
@@ -763,7 +5147,9 @@ static int zfifo_static_device_search(struct platform_device *pdev,
                                       int* pid,
                                       unsigned int* pdmac,
                                       unsigned int* mm2s_irq,
-                                      unsigned int* s2mm_irq){
+                                      unsigned int* s2mm_irq,
+                                      unsigned int* len_bits,
+                                      int* coherent){
   int id;
   int found = 0;
 
@@ -774,6 +5160,8 @@ static int zfifo_static_device_search(struct platform_device *pdev,
       *pdmac = zfifo_static_device_list[id].dmac;
       *mm2s_irq = zfifo_static_device_list[id].mm2s_irq;
       *s2mm_irq = zfifo_static_device_list[id].s2mm_irq;
+      *len_bits = zfifo_static_device_list[id].len_bits;
+      *coherent = zfifo_static_device_list[id].coherent;
       found  = 1;
       break;
     }
@@ -790,10 +5178,17 @@ static int zfifo_static_device_search(struct platform_device *pdev,
   MODULE_PARM_DESC(mm2s ## __num, DRIVER_NAME #__num " MM2S IRQ");   \
   static unsigned  s2mm ## __num = 0;                                \
   module_param    (s2mm ## __num, uint, S_IRUGO);                    \
-  MODULE_PARM_DESC(s2mm ## __num, DRIVER_NAME #__num " S2MM IRQ");
+  MODULE_PARM_DESC(s2mm ## __num, DRIVER_NAME #__num " S2MM IRQ");   \
+  static unsigned  lenbits ## __num = 0;                             \
+  module_param    (lenbits ## __num, uint, S_IRUGO);                 \
+  MODULE_PARM_DESC(lenbits ## __num, DRIVER_NAME #__num " sg length width (8-26)"); \
+  static int       coherent ## __num = 0;                            \
+  module_param    (coherent ## __num, int, S_IRUGO);                 \
+  MODULE_PARM_DESC(coherent ## __num, DRIVER_NAME #__num " on an I/O coherent port (ACP/HPC)");
 
 #define CALL_ZFIFO_STATIC_DEVICE_CREATE(__num)          \
-  zfifo_static_device_create(__num,  zfifo ## __num, mm2s ## __num, s2mm ## __num);
+  zfifo_static_device_create(__num,  zfifo ## __num, mm2s ## __num, s2mm ## __num, \
+                             lenbits ## __num, coherent ## __num);
 
 DEFINE_ZFIFO_STATIC_DEVICE_PARAM(0);
 DEFINE_ZFIFO_STATIC_DEVICE_PARAM(1);
@@ -826,13 +5221,27 @@ static void zfifo_static_device_remove_all(void){
 // Interrupt handler
 
 irqreturn_t zfifo_intr(int irq, void *dev_id){
-  //   printk("zfifo: intr %d\n", irq);
-
   zfifo_device_data *this;
   this = (zfifo_device_data*)dev_id;
 
-  if (irq == this->mm2s_irq) wake_up(&this->mm2s_waitq);
-  if (irq == this->s2mm_irq) wake_up(&this->s2mm_waitq);
+  // one interrupt may cover several completions (irq_threshold/irq_delay),
+  // waiters retire all of them from the descriptor status words
+  if (irq == this->mm2s.irq){
+    this->dma_regs[MM2S_DMASR] = DMASR_IRQ_MASK;
+    atomic_inc(&this->mm2s.irq_events);
+    atomic64_set(&this->mm2s.t_irq, ktime_get_ns());
+    trace_zfifo_irq(ZFIFO_TRACE_MINOR(this), 0, irq);
+  }
+  if (irq == this->s2mm.irq){
+    this->dma_regs[S2MM_DMASR] = DMASR_IRQ_MASK;
+    atomic_inc(&this->s2mm.irq_events);
+    atomic64_set(&this->s2mm.t_irq, ktime_get_ns());
+    trace_zfifo_irq(ZFIFO_TRACE_MINOR(this), 1, irq);
+  }
+  if (atomic_read(&this->nr_evfd) != 0 || atomic_read(&this->nr_async) != 0 ||
+      this->rxring != NULL)
+    schedule_work(&this->reap_work);
+  wake_up_all(&this->waitq);
   
   return IRQ_HANDLED;
 }
@@ -845,14 +5254,16 @@ static int zfifo_platform_driver_cleanup(struct platform_device *pdev,
   int retval = 0;
 
   if (this != NULL) {
-    if (this->mm2s_irq != 0){
-      irq_dispose_mapping(this->mm2s_irq);
-      free_irq(this->mm2s_irq, NULL);
+#ifndef ZFIFO_EMU
+    if (this->mm2s.irq != 0){
+      free_irq(this->mm2s.irq, this);
+      irq_dispose_mapping(this->mm2s.irq);
     }
-    if (this->s2mm_irq != 0){
-      irq_dispose_mapping(this->s2mm_irq);
-      free_irq(this->s2mm_irq, NULL);
+    if (this->s2mm.irq != 0){
+      free_irq(this->s2mm.irq, this);
+      irq_dispose_mapping(this->s2mm.irq);
     }
+#endif
     retval = zfifo_device_destroy(this);
     dev_set_drvdata(&pdev->dev, NULL);
     of_reserved_mem_device_release(&pdev->dev);
@@ -871,6 +5282,8 @@ static int zfifo_platform_driver_probe(struct platform_device *pdev){
   unsigned int                dmac         = 0; // FIXME for 64bit
   unsigned int                mm2s_irq     = 0;
   unsigned int                s2mm_irq     = 0;
+  unsigned int                len_bits     = 0;
+  int                         coherent     = 0;
   int                         minor_number = -1;
   zfifo_device_data*          this         = NULL;
   const char*                 device_name  = NULL;
@@ -880,7 +5293,8 @@ static int zfifo_platform_driver_probe(struct platform_device *pdev){
 #endif
 
   if (zfifo_static_device_search(pdev, &minor_number,
-                                 &dmac, &mm2s_irq, &s2mm_irq) == 0) {
+                                 &dmac, &mm2s_irq, &s2mm_irq,
+                                 &len_bits, &coherent) == 0) {
     /* 
     // still not 64bit compatible 
 
@@ -918,9 +5332,41 @@ static int zfifo_platform_driver_probe(struct platform_device *pdev){
 
   // TODO: this->hogehoge = foobar
 
-  this->dmac_buf_len = (2u << (dmac_buf_bits-1)) - 1;
+  // buffer length register width: lenbitsN=, the AXI DMA's
+  // xlnx,sg-length-width in the device tree, or the default
+  if (len_bits == 0 && pdev->dev.of_node != NULL)
+    of_property_read_u32(pdev->dev.of_node, "xlnx,sg-length-width",
+                         &len_bits);
+  if (len_bits == 0)
+    len_bits = dmac_buf_bits;
+  if (len_bits < 8 || len_bits > 26){
+    dev_warn(&pdev->dev, "invalid sg length width %u, using %d\n",
+             len_bits, dmac_buf_bits);
+    len_bits = dmac_buf_bits;
+  }
+  this->dmac_buf_len = (2u << (len_bits-1)) - 1;
+
+  // AXI DMA on an I/O coherent port: coherentN=1 or dma-coherent
+  if (pdev->dev.of_node != NULL &&
+      of_property_read_bool(pdev->dev.of_node, "dma-coherent"))
+    coherent = 1;
+  this->coherent = (coherent != 0);
 
   // AXI DMA registers
+#ifdef ZFIFO_EMU
+  // emulated core: registers in memory, no interrupt lines
+  if (pdev->dev.dma_mask == NULL)
+    pdev->dev.dma_mask = &pdev->dev.coherent_dma_mask;
+  if ((retval=zfifo_emu_create(this)) != 0){
+    dev_err(&pdev->dev, "couldn't start AXI DMA emulator. return=%d\n",
+            retval);
+    goto failed;
+  }
+  mm2s_irq = s2mm_irq = 0;
+  if (info_enable)
+    dev_info(&pdev->dev, "emulated AXI DMA, %s core\n",
+             emu_mode ? "vec-accum" : "loopback");
+#else
   this->dma_regs_phys = (unsigned*)dmac;
   if (!request_mem_region(dmac, dma_reg_size, "AXI DMA REGS")){
     dev_err(&pdev->dev, "couldn't map AXI DMA registers.\n");
@@ -932,6 +5378,9 @@ static int zfifo_platform_driver_probe(struct platform_device *pdev){
 #else
   this->dma_regs = ioremap_nocache(dmac, dma_reg_size);
 #endif
+#endif
+  zfifo_chan_init(&this->mm2s, this->dma_regs + MM2S_DMACR, DMA_TO_DEVICE);
+  zfifo_chan_init(&this->s2mm, this->dma_regs + S2MM_DMACR, DMA_FROM_DEVICE);
 
   
   printk("MM2S_DMASR: 0x%x irq %u\n", this->dma_regs[MM2S_DMASR], mm2s_irq);
@@ -959,6 +5408,13 @@ static int zfifo_platform_driver_probe(struct platform_device *pdev){
     goto failed;
   }
 
+#ifdef ZFIFO_EMU
+  if (emu_irq){ // raised by the emulator thread
+    this->mm2s.irq = ZFIFO_EMU_MM2S_IRQ;
+    this->s2mm.irq = ZFIFO_EMU_S2MM_IRQ;
+  }
+#endif
+
   // Find interrupt controller
   if (mm2s_irq != 0 || s2mm_irq != 0){
     struct device_node *dn;
@@ -993,7 +5449,7 @@ static int zfifo_platform_driver_probe(struct platform_device *pdev){
         printk(KERN_ERR "MM2S IRQ reg failed %d\n", result);
         goto failed;
       }
-      init_waitqueue_head(&this->mm2s_waitq);
+      this->mm2s.irq = mm2s_irq;
     }
 
     if (s2mm_irq != 0){
@@ -1007,13 +5463,23 @@ static int zfifo_platform_driver_probe(struct platform_device *pdev){
         printk(KERN_ERR "S2MM IRQ reg failed %d\n", result);
         goto failed;
       }
-      init_waitqueue_head(&this->s2mm_waitq);
+      this->s2mm.irq = s2mm_irq;
     }
 
   }
-  this->mm2s_irq = mm2s_irq;
-  this->s2mm_irq = s2mm_irq;
     
+  if (zfifo_set_coalesce(this, irq_threshold, irq_delay) != 0){
+    dev_warn(&pdev->dev, "invalid irq_threshold/irq_delay, using 1/0\n");
+    zfifo_set_coalesce(this, 1, 0);
+  }
+
+  this->wait_policy = (wait_policy >= 0 && wait_policy <= ZFIFO_WAIT_HYBRID) ?
+    wait_policy : ZFIFO_WAIT_HYBRID;
+  this->poll_us = (poll_us >= 0) ? poll_us : 0;
+  this->rxring_slots     = rxring_slots;
+  this->rxring_slot_size = rxring_slot_size;
+  zfifo_bench_create(this);
+
   if (info_enable) {
     zfifo_device_info(this);
     dev_info(&pdev->dev, "driver installed.\n");
@@ -1077,6 +5543,7 @@ static void zfifo_module_cleanup(void){
 
   if (zfifo_sys_class != NULL)
     class_destroy(zfifo_sys_class);
+  debugfs_remove_recursive(zfifo_debugfs_root);
   
   if (zfifo_device_number != 0)
     unregister_chrdev_region(zfifo_device_number , 0);
@@ -1107,6 +5574,8 @@ static int __init zfifo_module_init(void){
     retval = (retval == 0) ? -ENOMEM : retval;
     goto failed;
   }
+  zfifo_sys_class->dev_groups = zfifo_groups;
+  zfifo_debugfs_root = debugfs_create_dir(DRIVER_NAME, NULL);
 
   zfifo_static_device_create_all();
 
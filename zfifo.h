@@ -8,16 +8,239 @@ typedef struct {
   char * data;
 } zfifo_io;
 
+// Buffer registration (IOCTL_REG_BUF): pinned & mapped once, used by handle
+typedef struct {
+  unsigned long len;
+  char * data;
+  int flags;           // ZFIFO_REG_SEND and/or ZFIFO_REG_RECV
+} zfifo_reg;
+
+typedef struct {
+  int handle;          // returned by IOCTL_REG_BUF
+  unsigned long len;   // bytes from the head of the buffer, 0 = whole buffer
+} zfifo_reg_io;
+
+#define ZFIFO_REG_SEND (1<<0)
+#define ZFIFO_REG_RECV (1<<1)
+
+// Asynchronous transfers (IOCTL_SUBMIT_SEND/RECV, then IOCTL_WAIT)
+typedef unsigned long long zfifo_cookie;
+
+typedef struct {
+  unsigned long len;   // for handle: bytes from the head, 0 = whole buffer
+  char * data;         // user buffer, or NULL to use handle
+  int handle;          // registered buffer handle (data == NULL)
+  zfifo_cookie cookie; // out
+} zfifo_async_io;
+
+#define ZFIFO_PENDING (-4096L) // neither a length nor an -errno
+
+typedef struct {
+  zfifo_cookie cookie; // in
+  long result;         // out: 0 for a send, bytes received for a receive,
+                       // -errno, or ZFIFO_PENDING
+} zfifo_cpl;
+
+typedef struct {
+  zfifo_cpl * cpl;
+  unsigned n;          // # of entries in cpl (up to 1024)
+  unsigned min;        // block until at least min entries completed
+} zfifo_wait_io;
+
+// Send + receive in one call (IOCTL_XFER)
+typedef struct {
+  unsigned long txlen;
+  char * txdata;
+  unsigned long rxlen;
+  char * rxdata;
+} zfifo_xfer_io;
+
+// Vectored send/recv (IOCTL_SENDV/RECVV): segments form one packet
+typedef struct {
+  zfifo_io * seg;
+  unsigned nseg;       // up to 1024
+} zfifo_iov_io;
+
+// Packetized send/recv (IOCTL_SEND_FRAMES/RECV_FRAMES): TLAST every frame
+typedef struct {
+  unsigned long offset; // from the head of the buffer
+  unsigned long len;
+} zfifo_frame;
+
+typedef struct {
+  unsigned long len;
+  char * data;
+  unsigned long frame;  // frame (packet) size
+  zfifo_frame * frames; // recv: out, len/frame entries (rounded up)
+} zfifo_frame_io;
+
+// Receive one packet of up to len bytes (IOCTL_RECV_EOP)
+typedef struct {
+  unsigned long len;   // buffer size
+  char * data;
+  unsigned eof_desc;   // out: descriptor (from 0) the packet ended in
+} zfifo_recv_io;
+
+// Send/recv with a per-transfer report (IOCTL_SEND_EX/RECV_EX), also
+// filled in when the DMA fails. Times are CLOCK_MONOTONIC in ns.
+typedef struct {
+  unsigned long len;        // buffer size
+  char * data;
+  unsigned long actual;     // out: bytes moved by the DMA
+  unsigned ndesc;           // out: # of descriptors
+  unsigned dmasr;           // out: DMASR error bits (0x770) seen
+  long long t_submit;       // out: queued
+  long long t_start;        // out: handed to the DMA (TAILDESC)
+  long long t_irq;          // out: completion interrupt (or poll)
+  long long t_return;       // out: returning to user space
+} zfifo_io_ex;
+
+// Receive ring, mmap()ed at offset 0: this header, then nslots slots of
+// slot_size bytes at data_offset. prod/cons count up forever (slot =
+// index % nslots); user space reads slots [cons, prod) and then advances
+// cons to give them back.
+typedef struct {
+  volatile unsigned prod;   // written by the driver
+  volatile unsigned cons;   // written by user space
+  unsigned nslots;
+  unsigned slot_size;
+  unsigned data_offset;     // from the head of the mapping
+  unsigned len[];           // bytes in the slot, | ZFIFO_RXRING_MORE
+} zfifo_rxring;
+
+#define ZFIFO_RXRING_MORE (1u<<31) // packet continues in the next slot
+
+// Kernel-bypass queues (IOCTL_BYPASS_SETUP, then mmap() the regions).
+// User space posts entries into a queue and advances sq_tail (doorbell);
+// the driver checks them against the buffer pool, writes the descriptors
+// and advances sq_head. Entry i uses descriptor i % depth: it is done when
+// i < sq_head and the descriptor status has ZFIFO_BYPASS_CMPLT. Consumed
+// entries are returned by advancing cq_head.
+#define ZFIFO_BYPASS_TX 0
+#define ZFIFO_BYPASS_RX 1
+
+typedef struct {
+  unsigned depth;           // entries per queue, power of 2
+  unsigned pool_size;       // bytes
+} zfifo_bypass_setup;
+
+typedef struct {
+  unsigned offset;          // in the pool
+  unsigned len;             // bytes to send / buffer size to receive
+  unsigned flags;           // TX: ZFIFO_BYPASS_SOF | ZFIFO_BYPASS_EOF
+  unsigned reserved;
+} zfifo_bypass_entry;
+
+typedef struct {
+  volatile unsigned sq_tail; // user: # of entries posted (doorbell)
+  volatile unsigned sq_head; // driver: # of entries given to the DMA
+  volatile unsigned cq_head; // user: # of entries completed and consumed
+  unsigned entries;          // offset of the entry array in this region
+} zfifo_bypass_queue;
+
+typedef struct {
+  unsigned depth;
+  unsigned pool_size;
+  unsigned desc_offset[2];  // first descriptor in the TX/RX desc regions
+  volatile unsigned flags;  // ZFIFO_BYPASS_NEED_WAKEUP, ZFIFO_BYPASS_ERROR
+  zfifo_bypass_queue q[2];
+} zfifo_bypass_ctl;
+
+#define ZFIFO_BYPASS_SOF (1u<<27)
+#define ZFIFO_BYPASS_EOF (1u<<26)
+
+#define ZFIFO_BYPASS_NEED_WAKEUP (1u<<0) // call IOCTL_BYPASS_WAKEUP
+#define ZFIFO_BYPASS_ERROR       (1u<<1) // bad entry or DMA error
+
+// descriptor: 16 words, status in word 7
+#define ZFIFO_BYPASS_CMPLT   (1u<<31)
+#define ZFIFO_BYPASS_STS_ERR (7u<<28)
+#define ZFIFO_BYPASS_RXEOF   (1u<<26)
+#define ZFIFO_BYPASS_STS_LEN 0x03FFFFFF
+
+// mmap() offsets
+#define ZFIFO_MMAP_RXRING        0x00000000UL
+#define ZFIFO_MMAP_BYPASS_CTL    0x10000000UL
+#define ZFIFO_MMAP_BYPASS_TXDESC 0x20000000UL // read only
+#define ZFIFO_MMAP_BYPASS_RXDESC 0x30000000UL // read only
+#define ZFIFO_MMAP_BYPASS_POOL   0x40000000UL
+
 #define ZFIFO_MAGIC 'Z'
 
 #define IOCTL_SEND _IOW(ZFIFO_MAGIC, 1, zfifo_io *)
 #define IOCTL_RECV _IOR(ZFIFO_MAGIC, 2, zfifo_io *)
 #define IOCTL_RESET _IOW(ZFIFO_MAGIC, 2, int)
+#define IOCTL_REG_BUF   _IOW(ZFIFO_MAGIC, 3, zfifo_reg *)
+#define IOCTL_UNREG_BUF _IOW(ZFIFO_MAGIC, 4, int)
+#define IOCTL_SEND_REG  _IOW(ZFIFO_MAGIC, 5, zfifo_reg_io *)
+#define IOCTL_RECV_REG  _IOW(ZFIFO_MAGIC, 6, zfifo_reg_io *)
+#define IOCTL_SUBMIT_SEND _IOWR(ZFIFO_MAGIC, 7, zfifo_async_io *)
+#define IOCTL_SUBMIT_RECV _IOWR(ZFIFO_MAGIC, 8, zfifo_async_io *)
+#define IOCTL_WAIT        _IOWR(ZFIFO_MAGIC, 9, zfifo_wait_io *)
+#define IOCTL_XFER        _IOW(ZFIFO_MAGIC, 10, zfifo_xfer_io *)
+#define IOCTL_SET_EVENTFD _IOW(ZFIFO_MAGIC, 11, int)
+#define IOCTL_SENDV       _IOW(ZFIFO_MAGIC, 12, zfifo_iov_io *)
+#define IOCTL_RECVV       _IOW(ZFIFO_MAGIC, 13, zfifo_iov_io *)
+#define IOCTL_SEND_FRAMES _IOW(ZFIFO_MAGIC, 14, zfifo_frame_io *)
+#define IOCTL_RECV_FRAMES _IOW(ZFIFO_MAGIC, 15, zfifo_frame_io *)
+#define IOCTL_RECV_EOP    _IOWR(ZFIFO_MAGIC, 16, zfifo_recv_io *)
+#define IOCTL_BYPASS_SETUP  _IOW(ZFIFO_MAGIC, 17, zfifo_bypass_setup *)
+#define IOCTL_BYPASS_WAKEUP _IOW(ZFIFO_MAGIC, 18, int)
+#define IOCTL_SEND_EX     _IOWR(ZFIFO_MAGIC, 19, zfifo_io_ex *)
+#define IOCTL_RECV_EX     _IOWR(ZFIFO_MAGIC, 20, zfifo_io_ex *)
 
 #ifndef _ZFIFO_DRIVER_
 int zf_send(int fd, char* data, unsigned long len);
 int zf_recv(int fd, char* data, unsigned long len);
 int zf_reset(int fd);
+int zf_recv_eop(int fd, char* data, unsigned long len, unsigned* eof_desc);
+int zf_send_ex(int fd, char* data, unsigned long len, zfifo_io_ex* ex);
+int zf_recv_ex(int fd, char* data, unsigned long len, zfifo_io_ex* ex);
+
+int zf_register(int fd, char* data, unsigned long len, int flags);
+int zf_unregister(int fd, int handle);
+int zf_send_reg(int fd, int handle, unsigned long len);
+int zf_recv_reg(int fd, int handle, unsigned long len);
+
+int zf_submit_send(int fd, char* data, unsigned long len, zfifo_cookie* cookie);
+int zf_submit_recv(int fd, char* data, unsigned long len, zfifo_cookie* cookie);
+int zf_submit_send_reg(int fd, int handle, unsigned long len,
+                       zfifo_cookie* cookie);
+int zf_submit_recv_reg(int fd, int handle, unsigned long len,
+                       zfifo_cookie* cookie);
+int zf_wait(int fd, zfifo_cpl* cpl, unsigned n, unsigned min);
+
+int zf_xfer(int fd, char* txdata, unsigned long txlen,
+            char* rxdata, unsigned long rxlen);
+
+int zf_set_eventfd(int fd, int efd);
+
+int zf_sendv(int fd, zfifo_io* seg, unsigned nseg);
+int zf_recvv(int fd, zfifo_io* seg, unsigned nseg);
+
+int zf_send_frames(int fd, char* data, unsigned long len, unsigned long frame);
+int zf_recv_frames(int fd, char* data, unsigned long len, unsigned long frame,
+                   zfifo_frame* frames);
+
+typedef struct {
+  int fd;
+  zfifo_bypass_ctl * ctl;
+  unsigned long ctl_size;
+  volatile unsigned * desc[2];  // first descriptor of each queue
+  volatile unsigned * desc_map[2];
+  unsigned long desc_size[2];
+  char * pool;
+  unsigned depth;
+  unsigned tail[2];             // posted, not yet rung
+  unsigned head[2];             // next entry to complete
+} zf_bypass;
+
+int zf_bypass_open(int fd, unsigned depth, unsigned pool_size, zf_bypass* bp);
+void zf_bypass_close(zf_bypass* bp);
+int zf_bypass_post(zf_bypass* bp, int q, unsigned offset, unsigned len,
+                   unsigned flags);
+void zf_bypass_doorbell(zf_bypass* bp, int q);
+int zf_bypass_poll(zf_bypass* bp, int q, unsigned* len);
 #endif
 
 #endif
@@ -0,0 +1,134 @@
+// zfifo tracepoints: one event per stage of a transfer, for ftrace/perf
+// (events/zfifo/*). dir is 0 for MM2S, 1 for S2MM.
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM zfifo
+
+#if !defined(_ZFIFO_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define _ZFIFO_TRACE_H_
+
+#include <linux/tracepoint.h>
+
+DECLARE_EVENT_CLASS(zfifo_xfer,
+  TP_PROTO(int minor, int dir, unsigned long len, unsigned ndesc),
+  TP_ARGS(minor, dir, len, ndesc),
+  TP_STRUCT__entry(
+    __field(int,           minor)
+    __field(int,           dir)
+    __field(unsigned long, len)
+    __field(unsigned,      ndesc)
+  ),
+  TP_fast_assign(
+    __entry->minor = minor;
+    __entry->dir   = dir;
+    __entry->len   = len;
+    __entry->ndesc = ndesc;
+  ),
+  TP_printk("zfifo%d %s len=%lu ndesc=%u", __entry->minor,
+            __entry->dir ? "s2mm" : "mm2s", __entry->len, __entry->ndesc)
+);
+
+// a transfer is handed to the channel queue
+DEFINE_EVENT(zfifo_xfer, zfifo_submit,
+  TP_PROTO(int minor, int dir, unsigned long len, unsigned ndesc),
+  TP_ARGS(minor, dir, len, ndesc));
+
+// user pages pinned (ndesc: # of pages)
+DEFINE_EVENT(zfifo_xfer, zfifo_pin,
+  TP_PROTO(int minor, int dir, unsigned long len, unsigned ndesc),
+  TP_ARGS(minor, dir, len, ndesc));
+
+// dma_map_sg() done (ndesc: # of mapped entries)
+DEFINE_EVENT(zfifo_xfer, zfifo_map,
+  TP_PROTO(int minor, int dir, unsigned long len, unsigned ndesc),
+  TP_ARGS(minor, dir, len, ndesc));
+
+// TAILDESC written
+DEFINE_EVENT(zfifo_xfer, zfifo_kick,
+  TP_PROTO(int minor, int dir, unsigned long len, unsigned ndesc),
+  TP_ARGS(minor, dir, len, ndesc));
+
+// a waiter woke up from sleep
+DEFINE_EVENT(zfifo_xfer, zfifo_wakeup,
+  TP_PROTO(int minor, int dir, unsigned long len, unsigned ndesc),
+  TP_ARGS(minor, dir, len, ndesc));
+
+// user pages unmapped and unpinned (ndesc: # of pages)
+DEFINE_EVENT(zfifo_xfer, zfifo_unpin,
+  TP_PROTO(int minor, int dir, unsigned long len, unsigned ndesc),
+  TP_ARGS(minor, dir, len, ndesc));
+
+// descriptor chain written to the ring
+TRACE_EVENT(zfifo_desc,
+  TP_PROTO(int minor, int dir, unsigned long len, unsigned ndesc,
+           unsigned merged),
+  TP_ARGS(minor, dir, len, ndesc, merged),
+  TP_STRUCT__entry(
+    __field(int,           minor)
+    __field(int,           dir)
+    __field(unsigned long, len)
+    __field(unsigned,      ndesc)
+    __field(unsigned,      merged)
+  ),
+  TP_fast_assign(
+    __entry->minor  = minor;
+    __entry->dir    = dir;
+    __entry->len    = len;
+    __entry->ndesc  = ndesc;
+    __entry->merged = merged;
+  ),
+  TP_printk("zfifo%d %s len=%lu ndesc=%u merged=%u", __entry->minor,
+            __entry->dir ? "s2mm" : "mm2s", __entry->len, __entry->ndesc,
+            __entry->merged)
+);
+
+// interrupt received
+TRACE_EVENT(zfifo_irq,
+  TP_PROTO(int minor, int dir, int irq),
+  TP_ARGS(minor, dir, irq),
+  TP_STRUCT__entry(
+    __field(int, minor)
+    __field(int, dir)
+    __field(int, irq)
+  ),
+  TP_fast_assign(
+    __entry->minor = minor;
+    __entry->dir   = dir;
+    __entry->irq   = irq;
+  ),
+  TP_printk("zfifo%d %s irq=%d", __entry->minor,
+            __entry->dir ? "s2mm" : "mm2s", __entry->irq)
+);
+
+// transfer retired from the ring
+TRACE_EVENT(zfifo_complete,
+  TP_PROTO(int minor, int dir, unsigned long len, unsigned ndesc,
+           long result),
+  TP_ARGS(minor, dir, len, ndesc, result),
+  TP_STRUCT__entry(
+    __field(int,           minor)
+    __field(int,           dir)
+    __field(unsigned long, len)
+    __field(unsigned,      ndesc)
+    __field(long,          result)
+  ),
+  TP_fast_assign(
+    __entry->minor  = minor;
+    __entry->dir    = dir;
+    __entry->len    = len;
+    __entry->ndesc  = ndesc;
+    __entry->result = result;
+  ),
+  TP_printk("zfifo%d %s len=%lu ndesc=%u result=%ld", __entry->minor,
+            __entry->dir ? "s2mm" : "mm2s", __entry->len, __entry->ndesc,
+            __entry->result)
+);
+
+#endif // _ZFIFO_TRACE_H_
+
+// outside the guard: define_trace.h includes this file again
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE zfifo_trace
+#include <trace/define_trace.h>